@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//!
+//! Benchmark of the pair kernels of PairKernel.h against the scalar loops
+//! that they replaced (sametype() with map lookups and string comparisons,
+//! and distance() of atoms). Atoms are synthetic: a bin of random positions
+//! in a box, types from a small table and charges from a few levels.
+//!
+//! Usage: pairkernel-bench [atoms [repeats [seed]]]
+//!
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "PairKernel.h"
+
+namespace {
+
+// categories of --similar, as in atomtypes.json
+const std::map<std::string,int> atomtypes {
+  {"C.3", 1}, {"C.2", 1}, {"C.ar", 1}, {"N.3", 2}, {"N.am", 2}, {"O.3", 3}, {"O.2", 3}
+};
+const std::vector<std::string> typenames { "C.3", "C.2", "C.ar", "N.3", "N.am", "O.3", "O.2", "S.3" };
+
+//! Atom as in o-lap: position is the centroid of merged atoms
+struct RefAtom {
+  std::string type;
+  double charge;
+  double sum[3];
+  unsigned long count;
+
+  bool mono() const { return 1 == count; }
+};
+
+bool sametype( const RefAtom& lhs, const RefAtom& rhs, bool similar, double charge )
+{
+  if ( charge < std::abs( lhs.charge - rhs.charge ) ) return false;
+  if ( similar ) {
+    auto lp = atomtypes.find( lhs.type );
+    auto rp = atomtypes.find( rhs.type );
+    if ( lp != atomtypes.end() && rp != atomtypes.end() ) return lp->second == rp->second;
+  }
+  return lhs.type == rhs.type;
+}
+
+double sdist( const RefAtom& lhs, const RefAtom& rhs )
+{
+  double s {};
+  for ( int i {}; i < 3; ++i ) {
+    const double d = lhs.sum[i] / lhs.count - rhs.sum[i] / rhs.count;
+    s += d * d;
+  }
+  return s;
+}
+
+double distance( const RefAtom& lhs, const RefAtom& rhs )
+{
+  auto dist = std::sqrt( sdist( lhs, rhs ) );
+  if ( lhs.mono() && rhs.mono() ) dist *= 2;
+  return dist;
+}
+
+std::vector<RefAtom> synthetic( size_t n, bool charged, std::mt19937& rng )
+{
+  std::uniform_real_distribution<double> coord( 0.0, 10.0 );
+  std::uniform_int_distribution<size_t> type( 0, typenames.size() - 1 );
+  std::uniform_int_distribution<int> level( -2, 2 );
+  std::uniform_int_distribution<int> merged( 0, 3 );
+  std::vector<RefAtom> atoms;
+  for ( size_t i {}; i < n; ++i ) {
+    // a quarter of the atoms are clusters of two or more atoms
+    const unsigned long count = 0 == merged( rng ) ? 2 + merged( rng ) : 1;
+    RefAtom atom { typenames[type( rng )], charged ? 0.5 * level( rng ) : 0.0, {}, count };
+    for ( auto& s : atom.sum ) s = count * coord( rng );
+    atoms.push_back( atom );
+  }
+  return atoms;
+}
+
+//! Same as loadpairs() of o-lap
+void loadpairs( PairData& d, const std::vector<RefAtom>& atoms, bool similar, double chargediff )
+{
+  d.clear();
+  std::map<std::string,int> others;
+  double qmin {};
+  double qmax {};
+  for ( const auto& atom : atoms ) {
+    d.x.push_back( atom.sum[0] / atom.count );
+    d.y.push_back( atom.sum[1] / atom.count );
+    d.z.push_back( atom.sum[2] / atom.count );
+    d.charge.push_back( atom.charge );
+    int key;
+    auto lp = atomtypes.find( atom.type );
+    if ( similar && lp != atomtypes.end() ) key = lp->second;
+    else key = others.emplace( atom.type, (1 << 20) + int(others.size()) ).first->second;
+    d.key.push_back( key );
+    d.mono.push_back( atom.mono() );
+    d.allmono = d.allmono && atom.mono();
+    qmin = d.size() == 1 ? atom.charge : std::min( qmin, atom.charge );
+    qmax = d.size() == 1 ? atom.charge : std::max( qmax, atom.charge );
+  }
+  d.chargetest = chargediff < qmax - qmin;
+}
+
+template<class F>
+double seconds( int repeats, F f )
+{
+  double best {1e300};
+  for ( int r {}; r < repeats; ++r ) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    best = std::min( best, took.count() );
+  }
+  return best;
+}
+
+//! Runs both loops of both kernels on one bin. Returns false, if results differ.
+bool bench( const char* name, const std::vector<RefAtom>& atoms, bool similar, int repeats )
+{
+  constexpr double chargediff = 0.2;
+  constexpr double maxdist = 4.0 * 4.0;
+  const size_t n = atoms.size();
+  std::vector<size_t> all( n );
+  for ( size_t i {}; i < n; ++i ) all[i] = i;
+
+  PairData data;
+  loadpairs( data, atoms, similar, chargediff );
+  const auto dkernel = distancekernel( data );
+  const auto ekernel = edgekernel( data );
+
+  std::vector<double> refmat( n * n, 99999999.0 );
+  std::vector<double> newmat( n * n, 99999999.0 );
+  std::vector<std::pair<size_t,double>> refedges;
+  std::vector<std::pair<size_t,double>> newedges;
+  std::vector<size_t> cand;
+
+  const double tref = seconds( repeats, [&]() {
+    for ( size_t row {}; row + 1 < n; ++row ) {
+      for ( size_t col = row + 1; col < n; ++col ) {
+        if ( sametype( atoms[row], atoms[col], similar, chargediff ) ) {
+          refmat[ row * n + col ] = distance( atoms[row], atoms[col] );
+        }
+      }
+    }
+  } );
+  const double tnew = seconds( repeats, [&]() {
+    for ( size_t row {}; row + 1 < n; ++row ) {
+      cand.assign( all.begin() + row + 1, all.end() );
+      dkernel( data, row, cand, chargediff, newmat.data() + row * n );
+    }
+  } );
+  const double eref = seconds( repeats, [&]() {
+    refedges.clear();
+    for ( size_t row {}; row + 1 < n; ++row ) {
+      for ( size_t col = row + 1; col < n; ++col ) {
+        if ( sametype( atoms[row], atoms[col], similar, chargediff ) ) {
+          auto d = maxdist - sdist( atoms[row], atoms[col] );
+          if ( 0 < d ) refedges.emplace_back( row * n + col, d );
+        }
+      }
+    }
+  } );
+  std::vector<std::pair<size_t,double>> rowedges;
+  const double enew = seconds( repeats, [&]() {
+    newedges.clear();
+    for ( size_t row {}; row + 1 < n; ++row ) {
+      cand.assign( all.begin() + row + 1, all.end() );
+      rowedges.clear();
+      ekernel( data, row, cand, chargediff, maxdist, rowedges );
+      for ( const auto& e : rowedges ) newedges.emplace_back( row * n + e.first, e.second );
+    }
+  } );
+
+  const bool same = refmat == newmat && refedges == newedges;
+  const double pairs = 0.5 * n * (n - 1);
+  std::cout << std::left << std::setw( 22 ) << name << std::right << std::fixed << std::setprecision( 2 )
+            << std::setw( 10 ) << 1e9 * tref / pairs << std::setw( 10 ) << 1e9 * tnew / pairs
+            << std::setw( 8 ) << tref / tnew << 'x'
+            << std::setw( 10 ) << 1e9 * eref / pairs << std::setw( 10 ) << 1e9 * enew / pairs
+            << std::setw( 8 ) << eref / enew << 'x'
+            << "  " << (same ? "same" : "DIFFERENT") << '\n';
+  return same;
+}
+
+} // namespace
+
+int main( int argc, char *argv[] )
+{
+  const size_t n = 1 < argc ? std::strtoul( argv[1], nullptr, 10 ) : 2000;
+  const int repeats = 2 < argc ? std::atoi( argv[2] ) : 5;
+  const unsigned seed = 3 < argc ? std::strtoul( argv[3], nullptr, 10 ) : 1;
+  if ( n < 2 || repeats < 1 ) {
+    std::cerr << "Usage: " << argv[0] << " [atoms [repeats [seed]]]\n";
+    return 1;
+  }
+
+  std::mt19937 rng( seed );
+  const auto neutral = synthetic( n, false, rng );
+  const auto charged = synthetic( n, true, rng );
+  std::cout << "# " << n << " atoms, best of " << repeats << ", ns per pair\n"
+            << std::left << std::setw( 22 ) << "# bin" << std::right
+            << std::setw( 10 ) << "scalar" << std::setw( 10 ) << "distance" << std::setw( 9 ) << "speedup"
+            << std::setw( 10 ) << "scalar" << std::setw( 10 ) << "edge" << std::setw( 9 ) << "speedup" << '\n';
+  bool ok = true;
+  ok = bench( "neutral", neutral, false, repeats ) && ok;
+  ok = bench( "neutral --similar", neutral, true, repeats ) && ok;
+  ok = bench( "charged", charged, false, repeats ) && ok;
+  ok = bench( "charged --similar", charged, true, repeats ) && ok;
+  return ok ? 0 : 2;
+}
@@ -0,0 +1,59 @@
+# Generate DefaultTables.inc from the default JSON tables.
+#
+#   cmake -DCUTOFFS=<cutoffs.json> -DATOMTYPES=<atomtypes.json> -DOUTPUT=<file> -P EmbedTables.cmake
+#
+# The tables are flat JSON objects. Entries with numeric values become
+# constexpr {type, value} pairs; comments (string values) are skipped.
+# A repeated type keeps its last value, as in a JSON parser.
+
+function(read_table json result)
+  file(READ "${json}" text)
+  string(REGEX MATCHALL "\"[^\"]+\"[ \t]*:[ \t]*[-+0-9.eE]+" entries "${text}")
+  set(types)
+  set(values)
+  foreach(entry IN LISTS entries)
+    string(REGEX REPLACE "^\"([^\"]+)\".*$" "\\1" type "${entry}")
+    string(REGEX REPLACE "^.*:[ \t]*" "" value "${entry}")
+    list(FIND types "${type}" idx)
+    if(idx EQUAL -1)
+      list(APPEND types "${type}")
+      list(APPEND values "${value}")
+    else()
+      list(REMOVE_AT values ${idx})
+      list(INSERT values ${idx} "${value}")
+    endif()
+  endforeach()
+  set(lines)
+  list(LENGTH types count)
+  if(count GREATER 0)
+    math(EXPR last "${count} - 1")
+    foreach(idx RANGE ${last})
+      list(GET types ${idx} type)
+      list(GET values ${idx} value)
+      string(APPEND lines "  { \"${type}\", ${value} },\n")
+    endforeach()
+  endif()
+  set(${result} "${lines}" PARENT_SCOPE)
+endfunction()
+
+read_table("${CUTOFFS}" cutoffs)
+read_table("${ATOMTYPES}" atomtypes)
+
+get_filename_component(cutoffsname "${CUTOFFS}" NAME)
+get_filename_component(atomtypesname "${ATOMTYPES}" NAME)
+set(content "// Generated from ${cutoffsname} and ${atomtypesname} by EmbedTables.cmake. Do not edit.
+
+constexpr TypeValue<double> cutofftable[] {
+${cutoffs}};
+
+constexpr TypeValue<int> atomtypetable[] {
+${atomtypes}};
+")
+
+# keep timestamp, when content does not change
+if(EXISTS "${OUTPUT}")
+  file(READ "${OUTPUT}" old)
+endif()
+if(NOT old STREQUAL content)
+  file(WRITE "${OUTPUT}" "${content}")
+endif()
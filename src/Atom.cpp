@@ -16,7 +16,7 @@
  */
 
 #include <map>
-#include <numeric>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
 
@@ -24,10 +24,14 @@
 
 #include "Atom.h"
 
-Point Atom::pos() const
+//!
+//! Merge cluster 'other' into this. The most extreme charge is kept.
+//!
+void Atom::add( const Atom& other )
 {
-  auto avg = std::accumulate( begin(posit), end(posit), Point() );
-  return posit.size() ? avg / posit.size() : Point() ;
+  sum += other.sum;
+  count += other.count;
+  if ( std::abs(charge) < std::abs(other.charge) ) charge = other.charge;
 }
 
 std::ostream& print( std::ostream & out, const Atom & atom, unsigned long num )
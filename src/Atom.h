@@ -18,26 +18,31 @@
 #ifndef atom_h
 #define atom_h
 
-#include <vector>
 #include <iosfwd>
 #include <QString>
 
 #include "Point.h"
 
+//!
+//! Atom, or cluster of atoms as sum of member coordinates and member count.
+//!
 struct Atom {
-  QString serial;
+  unsigned long serial {};
   QString name;
-  std::vector<Point> posit;
+  Point   sum;
+  unsigned long count {1};
   QString type;
   double  charge {};
   bool    mark   {false};
+  unsigned long index {}; // position in its bin in model order
 
-  Atom( const QString& serial, const QString& name, const Point& pos, const QString& type, double charge )
-    : serial{serial}, name{name}, posit{pos}, type{type}, charge{charge}
+  Atom( unsigned long serial, const QString& name, const Point& pos, const QString& type, double charge )
+    : serial{serial}, name{name}, sum{pos}, type{type}, charge{charge}
   { }
 
-  Point pos() const;
-  bool mono() const { return 1 == posit.size(); }
+  Point pos() const { return sum / count; }
+  bool mono() const { return 1 == count; }
+  void add( const Atom& other );
 };
 
 std::ostream& print( std::ostream & out, const Atom & atom, unsigned long num );
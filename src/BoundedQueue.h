@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef boundedqueue_h
+#define boundedqueue_h
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//!
+//! FIFO queue between threads that holds at most 'capacity' items.
+//! Push waits while the queue is full, so a fast producer is held back
+//! by a slow consumer. After close() pushes fail and pops return the
+//! remaining items.
+//!
+template<class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue( size_t capacity ) : capacity{capacity < 1 ? 1 : capacity} {}
+
+  //! Wait for room and append 'item'. Returns false, if the queue is closed.
+  bool push( T&& item )
+  {
+    std::unique_lock<std::mutex> guard( lock );
+    notfull.wait( guard, [this]() { return closed || items.size() < capacity; } );
+    if ( closed ) return false;
+    items.push_back( std::move( item ) );
+    guard.unlock();
+    notempty.notify_one();
+    return true;
+  }
+
+  //! Wait for an item and move it to 'item'. Returns false, when the
+  //! queue is closed and empty.
+  bool pop( T& item )
+  {
+    std::unique_lock<std::mutex> guard( lock );
+    notempty.wait( guard, [this]() { return closed || ! items.empty(); } );
+    if ( items.empty() ) return false;
+    item = std::move( items.front() );
+    items.pop_front();
+    guard.unlock();
+    notfull.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      closed = true;
+    }
+    notfull.notify_all();
+    notempty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  std::mutex lock;
+  std::condition_variable notfull;
+  std::condition_variable notempty;
+  std::deque<T> items;
+  bool closed {false};
+};
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "ClusterState.h"
+
+namespace {
+const char* const stateheader = "# o-lap cluster state 1";
+
+const char statemagic[8] = { 'O', 'L', 'A', 'P', 'S', 'T', 'A', 'T' };
+constexpr quint32 stateversion = 2;
+
+// category of the slot that counts the clusters of a molecule
+constexpr qint32 molcat = std::numeric_limits<qint32>::min();
+
+quint64 slothash( quint64 molecule, const CellKey& key )
+{
+  return CellKeyHash()( key ) ^ (molecule * 0x9E3779B97F4A7C15ull);
+}
+}
+
+//!
+//! Read state from 'filename'. Format:
+//!   # o-lap cluster state 1
+//!   molecule <index> <clusters>
+//!   <type> <count> <sum x> <sum y> <sum z> <charge>
+//!
+bool ClusterState::read( const QString& filename )
+{
+  mols.clear();
+  QFile file( filename );
+  if ( !file.open( QIODevice::ReadOnly | QIODevice::Text ) ) return false;
+
+  QTextStream in( &file );
+  QString line;
+  if ( !in.readLineInto( &line ) || line.trimmed() != stateheader ) return false;
+
+  std::vector<Cluster>* current {nullptr};
+  while ( in.readLineInto( &line ) ) {
+#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
+    auto words = line.split( ' ', QString::SkipEmptyParts );
+#else
+    auto words = line.split( ' ', Qt::SkipEmptyParts );
+#endif
+    if ( words.isEmpty() || words.front().startsWith( "#" ) ) continue;
+    if ( words.front() == "molecule" && 3 == words.size() ) {
+      current = &mols[ words[1].toULong() ];
+      current->reserve( words[2].toULong() );
+    }
+    else if ( current && 6 == words.size() ) {
+      Cluster c;
+      c.type   = words[0];
+      c.count  = words[1].toULong();
+      c.sum    = Point{ words[2].toDouble(), words[3].toDouble(), words[4].toDouble() };
+      c.charge = words[5].toDouble();
+      current->push_back( c );
+    }
+    else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool ClusterState::write( const QString& filename ) const
+{
+  QSaveFile file( filename );
+  if ( !file.open( QIODevice::WriteOnly | QIODevice::Text ) ) return false;
+
+  QTextStream out( &file );
+  out << stateheader << '\n';
+  for ( const auto& mol : mols ) {
+    out << QString( "molecule %1 %2\n" ).arg( mol.first ).arg( mol.second.size() );
+    for ( const auto& c : mol.second ) {
+      out << QString( "%1 %2 %3 %4 %5 %6\n" )
+        .arg( c.type ).arg( c.count )
+        .arg( c.sum.x, 0, 'g', 17 ).arg( c.sum.y, 0, 'g', 17 ).arg( c.sum.z, 0, 'g', 17 )
+        .arg( c.charge, 0, 'g', 17 );
+    }
+  }
+  out.flush();
+  return file.commit();
+}
+
+
+void ClusterGrid::insert( size_t idx, int cat, const Point& pos )
+{
+  cells[ cellkey( cell, cat, pos ) ].push_back( idx );
+}
+
+
+void ClusterGrid::move( size_t idx, int cat, const Point& from, const Point& to )
+{
+  const auto src = cellkey( cell, cat, from );
+  const auto dst = cellkey( cell, cat, to );
+  if ( src == dst ) return;
+
+  auto& old = cells[ src ];
+  old.erase( std::find( old.begin(), old.end(), idx ) );
+  cells[ dst ].push_back( idx );
+}
+
+
+void ClusterGrid::erase( size_t idx, int cat, const Point& pos )
+{
+  auto& old = cells[ cellkey( cell, cat, pos ) ];
+  old.erase( std::find( old.begin(), old.end(), idx ) );
+}
+
+
+ConcurrentClusters::ConcurrentClusters( double cell, MergeLimit limit, size_t stripes )
+  : cell{cell}, limit{std::move( limit )}, stripes( std::max( size_t(1), stripes ) )
+{
+}
+
+
+bool ConcurrentClusters::add( int cat, const Cluster& atom, double reach )
+{
+  // A cluster within k cells of the atom stays there, when the atom
+  // joins it, because its new centroid is between the two.
+  const auto pos = atom.pos();
+  const auto c = cellkey( cell, cat, pos );
+  const int k = std::max( 1, int(std::ceil( reach / cell )) );
+  thread_local std::vector<CellKey> near;
+  thread_local std::vector<Stripe*> locked;
+  near.clear();
+  locked.clear();
+  for ( int dx = -k; dx <= k; ++dx ) {
+    for ( int dy = -k; dy <= k; ++dy ) {
+      for ( int dz = -k; dz <= k; ++dz ) {
+        near.push_back( CellKey{ cat, c.x + dx, c.y + dy, c.z + dz } );
+        locked.push_back( &stripe( near.back() ) );
+      }
+    }
+  }
+  std::shared_lock<std::shared_mutex> updating( pause );
+  std::sort( locked.begin(), locked.end() );
+  const auto last = std::unique( locked.begin(), locked.end() );
+  for ( auto it = locked.begin(); it != last; ++it ) (*it)->lock.lock();
+
+  std::vector<Cluster>* bestcell {nullptr};
+  size_t best {};
+  double bestdist {};
+  for ( const auto& k : near ) {
+    auto& cells = stripe( k ).cells;
+    auto it = cells.find( k );
+    if ( it == cells.end() ) continue;
+    auto& members = it->second;
+    for ( size_t idx {}; idx < members.size(); ++idx ) {
+      const auto& m = members[idx];
+      const double reach = limit( m, atom );
+      if ( reach < 0 ) continue;
+      const auto d = m.pos() - pos;
+      double dist = std::sqrt( dot( d, d ) );
+      if ( m.mono() && atom.mono() ) dist *= 2;
+      if ( reach < dist ) continue;
+      if ( nullptr == bestcell || dist < bestdist ) {
+        bestcell = &members;
+        best = idx;
+        bestdist = dist;
+      }
+    }
+  }
+
+  if ( bestcell ) {
+    Cluster& m = (*bestcell)[best];
+    const auto from = cellkey( cell, cat, m.pos() );
+    m.sum += atom.sum;
+    m.count += atom.count;
+    if ( std::abs(m.charge) < std::abs(atom.charge) ) m.charge = atom.charge;
+    const auto to = cellkey( cell, cat, m.pos() );
+    // rounding could, in theory, step out of the locked cells
+    const bool inside = std::abs( to.x - c.x ) <= k && std::abs( to.y - c.y ) <= k && std::abs( to.z - c.z ) <= k;
+    if ( inside && !( from == to ) ) {
+      stripe( to ).cells[to].push_back( std::move( m ) );
+      std::swap( m, bestcell->back() );
+      bestcell->pop_back();
+      if ( bestcell->empty() ) stripe( from ).cells.erase( from );
+    }
+  }
+  else {
+    stripe( c ).cells[c].push_back( atom );
+  }
+
+  for ( auto it = locked.begin(); it != last; ++it ) (*it)->lock.unlock();
+  return nullptr == bestcell;
+}
+
+
+std::vector<Cluster> ConcurrentClusters::snapshot() const
+{
+  std::unique_lock<std::shared_mutex> paused( pause );
+  std::vector<Cluster> all;
+  for ( const auto& s : stripes ) {
+    for ( const auto& cell : s.cells ) all.insert( all.end(), cell.second.begin(), cell.second.end() );
+  }
+  return all;
+}
+
+
+bool StateFile::istext( const QString& filename )
+{
+  QFile file( filename );
+  if ( !file.open( QIODevice::ReadOnly ) ) return false;
+  return file.readLine( 64 ).startsWith( stateheader );
+}
+
+
+bool StateFile::open( const QString& filename, double cell )
+{
+  close();
+  name = filename;
+  if ( !QFile::exists( filename ) ) {
+    return 0 < cell && rebuild( cell, 1024, 4096 );
+  }
+  return map();
+}
+
+
+void StateFile::close()
+{
+  if ( data ) file.unmap( data );
+  data = nullptr;
+  file.close();
+}
+
+
+bool StateFile::map()
+{
+  file.setFileName( name );
+  if ( !file.open( QIODevice::ReadWrite ) ) return false;
+  const quint64 size = file.size();
+  if ( size < sizeof(Header) || !( data = file.map( 0, size ) ) ) {
+    close();
+    return false;
+  }
+  const Header& h = *head();
+  const bool valid = 0 == std::memcmp( h.magic, statemagic, sizeof(statemagic) )
+    && stateversion == h.version
+    && std::isfinite( h.cell ) && 0 < h.cell
+    && 0 < h.slots && 0 == (h.slots & (h.slots - 1)) && h.used <= h.slots / 2
+    && h.records <= h.capacity
+    && h.slots <= size / sizeof(Slot) && h.capacity <= size / sizeof(Record)
+    && sizeof(Header) + h.slots * sizeof(Slot) + h.capacity * sizeof(Record) == size;
+  if ( !valid ) close();
+  return valid;
+}
+
+
+qint64 StateFile::probe( const Slot* table, quint64 n, quint64 molecule, const CellKey& key )
+{
+  const quint64 mask = n - 1;
+  quint64 i = slothash( molecule, key ) & mask;
+  for ( quint64 tries {}; tries < n; ++tries, i = (i + 1) & mask ) {
+    const Slot& s = table[i];
+    if ( !s.used ) return qint64(i);
+    if ( s.molecule == molecule && s.cat == key.cat && s.x == key.x && s.y == key.y && s.z == key.z ) {
+      return qint64(i);
+    }
+  }
+  return -1;
+}
+
+
+CellKey StateFile::keyof( double cell, const Record& r )
+{
+  const Point sum { r.sum[0], r.sum[1], r.sum[2] };
+  return cellkey( cell, r.cat, r.count ? sum / r.count : Point() );
+}
+
+
+qint64 StateFile::find( quint64 molecule, const CellKey& key ) const
+{
+  const auto s = probe( slots(), head()->slots, molecule, key );
+  return 0 <= s && slots()[s].used ? s : -1;
+}
+
+
+StateFile::Slot& StateFile::cellslot( quint64 molecule, const CellKey& key )
+{
+  // reserve() keeps the table at most half full, so a slot is found
+  Slot& s = slots()[ probe( slots(), head()->slots, molecule, key ) ];
+  if ( !s.used ) {
+    s = Slot{ molecule, key.cat, key.x, key.y, key.z, 1, -1 };
+    ++head()->used;
+  }
+  return s;
+}
+
+
+bool StateFile::reserve( quint64 records, quint64 slots )
+{
+  const Header& h = *head();
+  quint64 capacity = h.capacity;
+  quint64 nslots = h.slots;
+  while ( capacity < h.records + records ) capacity *= 2;
+  while ( nslots < 2 * (h.used + slots) ) nslots *= 2;
+  if ( capacity == h.capacity && nslots == h.slots ) return true;
+  return rebuild( h.cell, capacity, nslots );
+}
+
+
+bool StateFile::rebuild( double cell, quint64 capacity, quint64 nslots )
+{
+  const quint64 nrec = data ? head()->records : 0;
+
+  // link the records into a new table of cells
+  std::vector<Slot> table( nslots, Slot{} );
+  std::vector<qint64> next( nrec, -1 );
+  quint64 used {};
+  auto insert = [&]( quint64 molecule, const CellKey& key ) -> Slot& {
+    Slot& s = table[ probe( table.data(), nslots, molecule, key ) ];
+    if ( !s.used ) {
+      s = Slot{ molecule, key.cat, key.x, key.y, key.z, 1, -1 };
+      ++used;
+    }
+    return s;
+  };
+  if ( data ) {
+    for ( quint64 i {}; i < head()->slots; ++i ) {
+      const Slot& s = slots()[i];
+      if ( s.used && molcat == s.cat ) insert( s.molecule, CellKey{ s.cat, s.x, s.y, s.z } ).head = s.head;
+    }
+    for ( quint64 id {}; id < nrec; ++id ) {
+      const Record& r = records()[id];
+      Slot& s = insert( r.molecule, keyof( cell, r ) );
+      next[id] = s.head;
+      s.head = qint64(id);
+    }
+  }
+
+  Header h {};
+  std::memcpy( h.magic, statemagic, sizeof(statemagic) );
+  h.version = stateversion;
+  h.cell = cell;
+  h.records = nrec;
+  h.capacity = capacity;
+  h.slots = nslots;
+  h.used = used;
+
+  QSaveFile out( name );
+  if ( !out.open( QIODevice::WriteOnly ) ) return false;
+  bool ok = sizeof(h) == out.write( reinterpret_cast<const char*>( &h ), sizeof(h) );
+  ok = ok && qint64(nslots * sizeof(Slot)) == out.write( reinterpret_cast<const char*>( table.data() ),
+                                                         nslots * sizeof(Slot) );
+  for ( quint64 id {}; ok && id < nrec; ++id ) {
+    Record r = records()[id];
+    r.next = next[id];
+    ok = sizeof(r) == out.write( reinterpret_cast<const char*>( &r ), sizeof(r) );
+  }
+  const std::vector<char> zeros( 1 << 16 );
+  for ( quint64 left = (capacity - nrec) * sizeof(Record); ok && 0 < left; ) {
+    const qint64 n = std::min<quint64>( left, zeros.size() );
+    ok = n == out.write( zeros.data(), n );
+    left -= n;
+  }
+  if ( !ok || !out.commit() ) return false;
+
+  close();
+  return map();
+}
+
+
+quint64 StateFile::count( size_t molecule ) const
+{
+  const auto s = find( molecule, CellKey{ molcat, 0, 0, 0 } );
+  return s < 0 ? 0 : quint64( slots()[s].head );
+}
+
+
+Cluster StateFile::cluster( quint64 id ) const
+{
+  const Record& r = records()[id];
+  Cluster c;
+  c.type = QString::fromUtf8( r.type, int(strnlen( r.type, sizeof(r.type) )) );
+  c.sum = Point{ r.sum[0], r.sum[1], r.sum[2] };
+  c.count = r.count;
+  c.charge = r.charge;
+  return c;
+}
+
+
+bool StateFile::add( size_t molecule, int cat, const Cluster& c, quint64& id )
+{
+  const QByteArray type = c.type.toUtf8();
+  if ( sizeof(Record::type) <= size_t(type.size()) || !reserve( 1, 2 ) ) return false;
+
+  Slot& mol = cellslot( molecule, CellKey{ molcat, 0, 0, 0 } );
+  mol.head = std::max<qint64>( mol.head, 0 ) + 1;
+
+  id = head()->records++;
+  Record& r = records()[id];
+  r = Record{};
+  r.sum[0] = c.sum.x;
+  r.sum[1] = c.sum.y;
+  r.sum[2] = c.sum.z;
+  r.charge = c.charge;
+  r.count = c.count;
+  r.molecule = molecule;
+  r.serial = quint64( mol.head );
+  r.cat = cat;
+  std::memcpy( r.type, type.constData(), type.size() );
+
+  Slot& s = cellslot( molecule, keyof( cell(), r ) );
+  r.next = s.head;
+  s.head = qint64(id);
+  return true;
+}
+
+
+bool StateFile::update( quint64 id, const Cluster& c )
+{
+  if ( head()->records <= id || !reserve( 0, 1 ) ) return false;
+
+  Record& r = records()[id];
+  const auto from = keyof( cell(), r );
+  r.sum[0] = c.sum.x;
+  r.sum[1] = c.sum.y;
+  r.sum[2] = c.sum.z;
+  r.charge = c.charge;
+  r.count = c.count;
+  const auto to = keyof( cell(), r );
+  if ( from == to ) return true;
+
+  // move the record to the list of its new cell
+  const auto s = find( r.molecule, from );
+  if ( 0 <= s ) {
+    qint64* link = &slots()[s].head;
+    while ( 0 <= *link && quint64(*link) < head()->records && quint64(*link) != id ) link = &records()[*link].next;
+    if ( quint64(*link) == id ) *link = r.next;
+  }
+  Slot& dst = cellslot( r.molecule, to );
+  r.next = dst.head;
+  dst.head = qint64(id);
+  return true;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef clusterstate_h
+#define clusterstate_h
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <cmath>
+
+#include <QtCore>
+
+#include "Point.h"
+
+//!
+//! Cluster as sum of member coordinates, member count, and the most
+//! extreme charge of members.
+//!
+struct Cluster {
+  QString type;
+  Point   sum;
+  unsigned long count {};
+  double  charge {};
+
+  Point pos() const { return count ? sum / count : Point(); }
+  bool mono() const { return 1 == count; }
+};
+
+//!
+//! Clusters of each molecule of a model. Persisted as text, one cluster per line.
+//!
+class ClusterState {
+public:
+  bool read( const QString& filename );
+  bool write( const QString& filename ) const;
+
+  std::vector<Cluster>& clusters( size_t molecule ) { return mols[molecule]; }
+  const std::map<size_t,std::vector<Cluster>>& molecules() const { return mols; }
+
+private:
+  std::map<size_t,std::vector<Cluster>> mols;
+};
+
+//!
+//! Cell of a uniform grid within a type category
+//!
+struct CellKey {
+  int cat, x, y, z;
+  bool operator== ( const CellKey& rhs ) const
+  { return cat == rhs.cat && x == rhs.x && y == rhs.y && z == rhs.z; }
+};
+
+struct CellKeyHash {
+  size_t operator() ( const CellKey& k ) const
+  {
+    return ((size_t(k.cat) * 73856093) ^ (size_t(k.x) * 19349663)
+            ^ (size_t(k.y) * 83492791) ^ (size_t(k.z) * 2654435761u));
+  }
+};
+
+inline CellKey cellkey( double cell, int cat, const Point& pos )
+{
+  return CellKey{ cat, int(std::floor( pos.x / cell )), int(std::floor( pos.y / cell )),
+                  int(std::floor( pos.z / cell )) };
+}
+
+//!
+//! Uniform grid of cluster indices, keyed by type category and cell
+//!
+class ClusterGrid {
+public:
+  explicit ClusterGrid( double cell ) : cell{cell} {}
+
+  void insert( size_t idx, int cat, const Point& pos );
+  void move( size_t idx, int cat, const Point& from, const Point& to );
+  void erase( size_t idx, int cat, const Point& pos );
+
+  //! Call f(idx) for clusters in cells that are within one cell of 'pos'
+  template<class F>
+  void near( int cat, const Point& pos, F f ) const
+  {
+    const auto c = cellkey( cell, cat, pos );
+    for ( int dx = -1; dx < 2; ++dx ) {
+      for ( int dy = -1; dy < 2; ++dy ) {
+        for ( int dz = -1; dz < 2; ++dz ) {
+          auto it = cells.find( CellKey{ cat, c.x + dx, c.y + dy, c.z + dz } );
+          if ( it != cells.end() ) {
+            for ( auto idx : it->second ) f( idx );
+          }
+        }
+      }
+    }
+  }
+
+private:
+  double cell;
+  std::unordered_map<CellKey,std::vector<size_t>,CellKeyHash> cells;
+};
+
+//!
+//! Clusters of --state in a file that is updated in place. The file holds
+//! fixed size records of clusters and a hash table of grid cells, keyed by
+//! molecule, type category and cell, whose clusters are linked lists of
+//! records. Both are memory mapped, so a wave reads and writes only the
+//! cells and clusters near its atoms. Tables are doubled, when full, by
+//! rewriting the file, so adding a cluster costs amortized constant time.
+//!
+class StateFile {
+public:
+  StateFile() = default;
+  StateFile( const StateFile& ) = delete;
+  StateFile& operator= ( const StateFile& ) = delete;
+  ~StateFile() { close(); }
+
+  //! Open 'filename', or create it with grid 'cell'. False, if the file
+  //! is not a state of this format or is inconsistent.
+  bool open( const QString& filename, double cell );
+  void close();
+
+  //! True, if 'filename' is a text state of --partial
+  static bool istext( const QString& filename );
+
+  double cell() const { return head()->cell; }
+
+  //! Clusters of 'molecule'
+  quint64 count( size_t molecule ) const;
+
+  Cluster cluster( quint64 id ) const;
+  //! Number of cluster 'id' in its molecule, from 1
+  quint64 serial( quint64 id ) const { return records()[id].serial; }
+
+  //! Call f(id) for clusters of 'molecule' and category 'cat' in the cells
+  //! that are within 'reach' of 'pos'
+  template<class F>
+  void near( size_t molecule, int cat, const Point& pos, double reach, F f ) const
+  {
+    const auto c = cellkey( cell(), cat, pos );
+    const int k = std::max( 1, int(std::ceil( reach / cell() )) );
+    const Record* recs = records();
+    for ( int dx = -k; dx <= k; ++dx ) {
+      for ( int dy = -k; dy <= k; ++dy ) {
+        for ( int dz = -k; dz <= k; ++dz ) {
+          const auto s = find( molecule, CellKey{ cat, c.x + dx, c.y + dy, c.z + dz } );
+          if ( s < 0 ) continue;
+          for ( auto id = slots()[s].head; 0 <= id && quint64(id) < head()->records; id = recs[id].next ) {
+            f( quint64(id) );
+          }
+        }
+      }
+    }
+  }
+
+  //! Add 'c' of category 'cat' as last cluster of 'molecule'
+  bool add( size_t molecule, int cat, const Cluster& c, quint64& id );
+  //! Replace cluster 'id' with 'c' of the same type
+  bool update( quint64 id, const Cluster& c );
+
+  //! Call f(molecule, serial, cluster) for all clusters, in the order added
+  template<class F>
+  void all( F f ) const
+  {
+    for ( quint64 id {}; id < head()->records; ++id ) f( size_t(records()[id].molecule), serial( id ), cluster( id ) );
+  }
+
+private:
+  struct Header {
+    char    magic[8];
+    quint32 version;
+    quint32 pad;
+    double  cell;
+    quint64 records;   // in use
+    quint64 capacity;  // of records
+    quint64 slots;     // of hash table, a power of two
+    quint64 used;      // slots in use
+  };
+  struct Slot {
+    quint64 molecule;
+    qint32  cat, x, y, z;
+    quint32 used;
+    qint64  head;      // first record of cell, or count of a molecule slot
+  };
+  struct Record {
+    double  sum[3];
+    double  charge;
+    quint64 count;
+    quint64 molecule;
+    quint64 serial;
+    qint64  next;      // next record of the cell, or -1
+    qint32  cat;
+    char    type[20];
+  };
+
+  const Header* head() const { return reinterpret_cast<const Header*>( data ); }
+  Header* head() { return reinterpret_cast<Header*>( data ); }
+  const Slot* slots() const { return reinterpret_cast<const Slot*>( data + sizeof(Header) ); }
+  Slot* slots() { return reinterpret_cast<Slot*>( data + sizeof(Header) ); }
+  const Record* records() const
+  { return reinterpret_cast<const Record*>( data + sizeof(Header) + head()->slots * sizeof(Slot) ); }
+  Record* records()
+  { return reinterpret_cast<Record*>( data + sizeof(Header) + head()->slots * sizeof(Slot) ); }
+
+  //! Slot of cell in 'table' of 'n' slots, or the empty slot for it;
+  //! -1, if neither is found
+  static qint64 probe( const Slot* table, quint64 n, quint64 molecule, const CellKey& key );
+  static CellKey keyof( double cell, const Record& r );
+  //! Slot of cell, or -1
+  qint64 find( quint64 molecule, const CellKey& key ) const;
+  //! Slot of cell, added if missing; there must be room for it
+  Slot& cellslot( quint64 molecule, const CellKey& key );
+  //! Make room for 'records' more records and 'slots' more slots
+  bool reserve( quint64 records, quint64 slots );
+  //! Write the file with tables of 'capacity' records and 'nslots' slots
+  bool rebuild( double cell, quint64 capacity, quint64 nslots );
+  bool map();
+
+  QString name;
+  QFile file;
+  uchar* data {nullptr};
+};
+
+//!
+//! Clusters of a stream of atoms in a grid that several threads update
+//! at once. Cells are spread over stripes, each with a lock and a map of
+//! its cells. An update locks the stripes of the cells around the atom,
+//! in stripe order, so updates of distant atoms proceed in parallel.
+//! A snapshot pauses all updates.
+//! Only clusters are stored, so memory grows with the clusters, not with
+//! the atoms.
+//!
+class ConcurrentClusters {
+public:
+  //! Distance limit for merging 'atom' into cluster 'c', or negative,
+  //! if they can't merge. Called from several threads.
+  using MergeLimit = std::function<double( const Cluster& c, const Cluster& atom )>;
+
+  //! Grid of cells of size 'cell'; an atom searches the cells within its reach
+  ConcurrentClusters( double cell, MergeLimit limit, size_t stripes = 4096 );
+
+  //! Merge 'atom' into the nearest cluster of category 'cat' within limit,
+  //! or add it as a new cluster. 'reach' must not be less than the limit
+  //! of 'atom' with any cluster. Returns true, if a cluster was added.
+  bool add( int cat, const Cluster& atom, double reach );
+
+  //! Copy of all clusters at one moment
+  std::vector<Cluster> snapshot() const;
+
+private:
+  using Cells = std::unordered_map<CellKey,std::vector<Cluster>,CellKeyHash>;
+  struct Stripe {
+    std::mutex lock;
+    Cells cells;
+  };
+
+  Stripe& stripe( const CellKey& k ) { return stripes[ CellKeyHash()( k ) % stripes.size() ]; }
+
+  double cell;
+  MergeLimit limit;
+  std::vector<Stripe> stripes;
+  mutable std::shared_mutex pause; // shared by updates, exclusive for snapshot
+};
+
+#endif
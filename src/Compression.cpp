@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "Compression.h"
+
+namespace {
+
+constexpr qint64 inchunk  {1 << 18};
+constexpr int    outchunk {1 << 20};
+
+using Sink = std::function<bool( QByteArray&& )>;
+
+// Decompressors read 'file' and give chunks to 'sink' until it returns false.
+// They return false and set 'error' on failure.
+
+#ifdef HAVE_ZLIB
+bool gunzip( QFile& file, const Sink& sink, QString& error )
+{
+  z_stream zs {};
+  // gzip or zlib header
+  if ( Z_OK != inflateInit2( &zs, 15 + 32 ) ) {
+    error = "Can't initialize zlib";
+    return false;
+  }
+
+  std::vector<char> in( inchunk );
+  bool ended {false};
+  for ( ;; ) {
+    const qint64 got = file.read( in.data(), in.size() );
+    if ( got < 0 ) {
+      error = file.errorString();
+      inflateEnd( &zs );
+      return false;
+    }
+    if ( 0 == got ) break;
+
+    zs.next_in  = reinterpret_cast<Bytef*>( in.data() );
+    zs.avail_in = got;
+    bool full {true};
+    while ( full || 0 < zs.avail_in ) {
+      QByteArray out;
+      out.resize( outchunk );
+      zs.next_out  = reinterpret_cast<Bytef*>( out.data() );
+      zs.avail_out = out.size();
+      const int status = inflate( &zs, Z_NO_FLUSH );
+      if ( Z_STREAM_END == status ) {
+        // file may have more gzip members
+        ended = true;
+        inflateReset( &zs );
+      }
+      else if ( Z_OK == status ) {
+        ended = false;
+      }
+      else if ( Z_BUF_ERROR != status ) {
+        error = zs.msg ? zs.msg : "Corrupt gzip data";
+        inflateEnd( &zs );
+        return false;
+      }
+      full = 0 == zs.avail_out;
+      out.resize( out.size() - zs.avail_out );
+      if ( !out.isEmpty() && !sink( std::move( out ) ) ) {
+        inflateEnd( &zs );
+        return true;
+      }
+      if ( Z_BUF_ERROR == status ) break;
+    }
+  }
+  inflateEnd( &zs );
+  if ( !ended ) error = "Truncated gzip data";
+  return ended;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+bool unzstd( QFile& file, const Sink& sink, QString& error )
+{
+  ZSTD_DStream* zs = ZSTD_createDStream();
+  if ( nullptr == zs || ZSTD_isError( ZSTD_initDStream( zs ) ) ) {
+    error = "Can't initialize zstd";
+    ZSTD_freeDStream( zs );
+    return false;
+  }
+
+  std::vector<char> in( ZSTD_DStreamInSize() );
+  size_t last {};
+  for ( ;; ) {
+    const qint64 got = file.read( in.data(), in.size() );
+    if ( got < 0 ) {
+      error = file.errorString();
+      ZSTD_freeDStream( zs );
+      return false;
+    }
+    if ( 0 == got ) break;
+
+    ZSTD_inBuffer input { in.data(), size_t(got), 0 };
+    while ( input.pos < input.size ) {
+      QByteArray out;
+      out.resize( ZSTD_DStreamOutSize() );
+      ZSTD_outBuffer output { out.data(), size_t(out.size()), 0 };
+      last = ZSTD_decompressStream( zs, &output, &input );
+      if ( ZSTD_isError( last ) ) {
+        error = ZSTD_getErrorName( last );
+        ZSTD_freeDStream( zs );
+        return false;
+      }
+      out.resize( output.pos );
+      if ( !out.isEmpty() && !sink( std::move( out ) ) ) {
+        ZSTD_freeDStream( zs );
+        return true;
+      }
+    }
+  }
+  ZSTD_freeDStream( zs );
+  // nonzero hint means that a frame is not complete
+  if ( 0 != last ) error = "Truncated zstd data";
+  return 0 == last;
+}
+#endif
+
+bool copy( QFile& file, const Sink& sink, QString& error )
+{
+  for ( ;; ) {
+    QByteArray chunk = file.read( outchunk );
+    if ( chunk.isEmpty() ) break;
+    if ( !sink( std::move( chunk ) ) ) return true;
+  }
+  if ( QFileDevice::NoError != file.error() ) {
+    error = file.errorString();
+    return false;
+  }
+  return true;
+}
+
+#ifdef HAVE_ZLIB
+//!
+//! Deflates into gzip format
+//!
+class GzipBuf : public std::streambuf {
+public:
+  explicit GzipBuf( std::ostream& sink ) : sink{sink}, in( 1 << 16 ), out( 1 << 16 )
+  {
+    // gzip header
+    deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY );
+    setp( in.data(), in.data() + in.size() );
+  }
+
+  ~GzipBuf() override
+  {
+    deflatebuffer( Z_FINISH );
+    deflateEnd( &zs );
+    sink.flush();
+  }
+
+protected:
+  int_type overflow( int_type ch ) override
+  {
+    if ( !deflatebuffer( Z_NO_FLUSH ) ) return traits_type::eof();
+    if ( !traits_type::eq_int_type( ch, traits_type::eof() ) ) {
+      *pptr() = traits_type::to_char_type( ch );
+      pbump( 1 );
+    }
+    return traits_type::not_eof( ch );
+  }
+
+  int sync() override
+  {
+    return deflatebuffer( Z_SYNC_FLUSH ) && sink.flush() ? 0 : -1;
+  }
+
+private:
+  bool deflatebuffer( int flush )
+  {
+    zs.next_in  = reinterpret_cast<Bytef*>( pbase() );
+    zs.avail_in = pptr() - pbase();
+    int status {Z_OK};
+    do {
+      zs.next_out  = reinterpret_cast<Bytef*>( out.data() );
+      zs.avail_out = out.size();
+      status = deflate( &zs, flush );
+      if ( Z_STREAM_ERROR == status ) return false;
+      sink.write( out.data(), out.size() - zs.avail_out );
+    } while ( 0 == zs.avail_out );
+    setp( in.data(), in.data() + in.size() );
+    return bool(sink);
+  }
+
+  std::ostream& sink;
+  z_stream zs {};
+  std::vector<char> in;
+  std::vector<char> out;
+};
+#endif
+
+} // namespace
+
+
+Compression compression( const QString& filename )
+{
+  QFile file( filename );
+  if ( !file.open( QIODevice::ReadOnly ) ) return Compression::None;
+  return compression( file.read( 4 ) );
+}
+
+
+Compression compression( const QByteArray& magic )
+{
+  if ( 2 <= magic.size() && '\x1f' == magic[0] && '\x8b' == magic[1] ) return Compression::Gzip;
+  if ( 4 == magic.size() && 0 == std::memcmp( magic.constData(), "\x28\xb5\x2f\xfd", 4 ) ) {
+    return Compression::Zstd;
+  }
+  return Compression::None;
+}
+
+
+const char* compressionname( Compression format )
+{
+  switch ( format ) {
+  case Compression::Gzip: return "gzip";
+  case Compression::Zstd: return "zstd";
+  default: return "none";
+  }
+}
+
+
+bool supported( Compression format )
+{
+  switch ( format ) {
+#ifdef HAVE_ZLIB
+  case Compression::Gzip: return true;
+#endif
+#ifdef HAVE_ZSTD
+  case Compression::Zstd: return true;
+#endif
+  case Compression::None: return true;
+  default: return false;
+  }
+}
+
+
+InflateDevice::InflateDevice( const QString& filename, Compression format, size_t chunks )
+  : filename{filename}, format{format}, capacity{std::max( size_t(1), chunks )}
+{
+}
+
+
+InflateDevice::~InflateDevice()
+{
+  close();
+}
+
+
+bool InflateDevice::open( OpenMode mode )
+{
+  if ( isOpen() || ( mode & WriteOnly ) || !supported( format ) ) return false;
+  stop = false;
+  finished = false;
+  if ( !QIODevice::open( ReadOnly | Unbuffered ) ) return false;
+  worker = std::thread( [this]() { run(); } );
+  return true;
+}
+
+
+void InflateDevice::close()
+{
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    stop = true;
+  }
+  cond.notify_all();
+  if ( worker.joinable() ) worker.join();
+  queue.clear();
+  offset = 0;
+  if ( isOpen() ) QIODevice::close();
+}
+
+
+bool InflateDevice::atEnd() const
+{
+  std::lock_guard<std::mutex> guard( lock );
+  return finished && queue.empty();
+}
+
+
+qint64 InflateDevice::bytesAvailable() const
+{
+  std::lock_guard<std::mutex> guard( lock );
+  qint64 bytes = -offset;
+  for ( const auto& chunk : queue ) bytes += chunk.size();
+  return bytes + QIODevice::bytesAvailable();
+}
+
+
+bool InflateDevice::waitForReadyRead( int msecs )
+{
+  std::unique_lock<std::mutex> guard( lock );
+  auto ready = [this]() { return !queue.empty() || finished; };
+  if ( msecs < 0 ) cond.wait( guard, ready );
+  else cond.wait_for( guard, std::chrono::milliseconds( msecs ), ready );
+  return !queue.empty();
+}
+
+
+QString InflateDevice::error() const
+{
+  std::lock_guard<std::mutex> guard( lock );
+  return failure;
+}
+
+
+qint64 InflateDevice::readData( char* data, qint64 maxlen )
+{
+  return take( data, maxlen, false );
+}
+
+
+qint64 InflateDevice::readLineData( char* data, qint64 maxlen )
+{
+  return take( data, maxlen, true );
+}
+
+
+//!
+//! Copy up to 'maxlen' bytes, or up to end of 'line', from the queue.
+//! Waits until data is available. Returns -1 at end of data.
+//!
+qint64 InflateDevice::take( char* data, qint64 maxlen, bool line )
+{
+  std::unique_lock<std::mutex> guard( lock );
+  cond.wait( guard, [this]() { return !queue.empty() || finished; } );
+  if ( queue.empty() ) return -1;
+
+  qint64 copied {};
+  while ( copied < maxlen && !queue.empty() ) {
+    const auto& front = queue.front();
+    const char* p = front.constData() + offset;
+    qint64 n = std::min( maxlen - copied, qint64( front.size() - offset ) );
+    const void* eol = line ? std::memchr( p, '\n', n ) : nullptr;
+    if ( eol ) n = static_cast<const char*>( eol ) - p + 1;
+    std::memcpy( data + copied, p, n );
+    copied += n;
+    offset += n;
+    if ( offset == front.size() ) {
+      queue.pop_front();
+      offset = 0;
+    }
+    if ( eol ) break;
+  }
+  guard.unlock();
+  cond.notify_all();
+  return copied;
+}
+
+
+//!
+//! Wait for room in the queue and append 'chunk'.
+//! Returns false, if the device was closed.
+//!
+bool InflateDevice::push( QByteArray&& chunk )
+{
+  std::unique_lock<std::mutex> guard( lock );
+  cond.wait( guard, [this]() { return stop || queue.size() < capacity; } );
+  if ( stop ) return false;
+  queue.push_back( std::move( chunk ) );
+  guard.unlock();
+  cond.notify_all();
+  return true;
+}
+
+
+void InflateDevice::run()
+{
+  QString error;
+  QFile file( filename );
+  if ( !file.open( QIODevice::ReadOnly ) ) {
+    error = file.errorString();
+  }
+  else {
+    const Sink sink = [this]( QByteArray&& chunk ) { return push( std::move( chunk ) ); };
+    switch ( format ) {
+#ifdef HAVE_ZLIB
+    case Compression::Gzip: gunzip( file, sink, error ); break;
+#endif
+#ifdef HAVE_ZSTD
+    case Compression::Zstd: unzstd( file, sink, error ); break;
+#endif
+    default: copy( file, sink, error ); break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    finished = true;
+    failure = error;
+  }
+  cond.notify_all();
+}
+
+
+std::unique_ptr<std::streambuf> gzipbuf( std::ostream& sink )
+{
+#ifdef HAVE_ZLIB
+  return std::unique_ptr<std::streambuf>( new GzipBuf( sink ) );
+#else
+  (void)sink;
+  return nullptr;
+#endif
+}
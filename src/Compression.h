@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef compression_h
+#define compression_h
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <streambuf>
+#include <iosfwd>
+
+#include <QtCore>
+
+//!
+//! Compression of a file, recognized from its first bytes
+//!
+enum class Compression { None, Gzip, Zstd };
+
+Compression compression( const QString& filename );
+
+//! Compression of data that begins with 'magic'
+Compression compression( const QByteArray& magic );
+
+const char* compressionname( Compression format );
+
+//! True, if the program was built with support for 'format'
+bool supported( Compression format );
+
+//!
+//! Sequential read-only device of the decompressed content of a file.
+//! A background thread reads and decompresses the file into a bounded
+//! queue of chunks, so decompression overlaps the reader.
+//! Reads block until data is available or the file has ended.
+//!
+class InflateDevice : public QIODevice {
+public:
+  InflateDevice( const QString& filename, Compression format, size_t chunks = 8 );
+  ~InflateDevice() override;
+
+  bool open( OpenMode mode = ReadOnly ) override;
+  void close() override;
+  bool isSequential() const override { return true; }
+  bool atEnd() const override;
+  qint64 bytesAvailable() const override;
+  bool waitForReadyRead( int msecs ) override;
+
+  //! Description of failure, when input ended due to an error
+  QString error() const;
+
+protected:
+  qint64 readData( char* data, qint64 maxlen ) override;
+  qint64 readLineData( char* data, qint64 maxlen ) override;
+  qint64 writeData( const char*, qint64 ) override { return -1; }
+
+private:
+  void run();
+  bool push( QByteArray&& chunk );
+  qint64 take( char* data, qint64 maxlen, bool line );
+
+  QString filename;
+  Compression format;
+  size_t capacity;
+
+  std::thread worker;
+  mutable std::mutex lock;
+  std::condition_variable cond;
+  std::deque<QByteArray> queue;
+  int offset {};           // of unread data in queue.front()
+  bool finished {false};   // worker has pushed all data
+  bool stop {false};       // reader has closed
+  QString failure;
+};
+
+//!
+//! Stream buffer that writes gzip compressed data into 'sink'.
+//! The data is complete when the buffer is destroyed.
+//! Returns nullptr, if the program was built without zlib.
+//!
+std::unique_ptr<std::streambuf> gzipbuf( std::ostream& sink );
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DefaultTables.h"
+#include "TypeTable.h"
+
+namespace {
+
+#include "DefaultTables.inc"
+
+constexpr TypeHash<std::size( atomtypetable )> atomtypehash( atomtypetable );
+
+QString totype( std::string_view type )
+{
+  return QString::fromLatin1( type.data(), int( type.size() ) );
+}
+
+} // namespace
+
+
+QMap<QString, QVariant> defaultcutoffs()
+{
+  QMap<QString, QVariant> cutmap;
+  for ( const auto& entry : cutofftable ) cutmap.insert( totype( entry.type ), entry.value );
+  return cutmap;
+}
+
+
+std::map<QString,int> defaultatomtypes()
+{
+  std::map<QString,int> types;
+  for ( const auto& entry : atomtypetable ) types[totype( entry.type )] = entry.value;
+  return types;
+}
+
+
+int defaultatomtype( const QString& type )
+{
+  const int k = atomtypehash.find( type.utf16(), type.size() );
+  return k < 0 ? 0 : atomtypetable[k].value;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef defaulttables_h
+#define defaulttables_h
+
+#include <map>
+
+#include <QtCore>
+
+//!
+//! Default cutoffs and atom type categories. They are compiled in from
+//! data/cutoffs.json and data/atomtypes.json, so the program does not
+//! read or locate JSON files unless the user overrides the defaults.
+//!
+QMap<QString, QVariant> defaultcutoffs();
+
+std::map<QString,int> defaultatomtypes();
+
+//! Category of 'type' in the default table, or 0
+int defaultatomtype( const QString& type );
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <thread>
+
+#include "FollowDevice.h"
+
+FollowDevice::FollowDevice( const QString& filename, int interval )
+  : file{filename}, interval{std::max( 1, interval )}
+{
+}
+
+
+bool FollowDevice::open( OpenMode mode )
+{
+  if ( isOpen() || ( mode & WriteOnly ) ) return false;
+  // unbuffered, so that reads after the end see appended data
+  if ( !file.open( ReadOnly | Unbuffered ) ) {
+    setErrorString( file.errorString() );
+    return false;
+  }
+  return QIODevice::open( ReadOnly );
+}
+
+
+void FollowDevice::close()
+{
+  file.close();
+  QIODevice::close();
+}
+
+
+bool FollowDevice::atEnd() const
+{
+  return finished && 0 == QIODevice::bytesAvailable() && !grown();
+}
+
+
+bool FollowDevice::waitForReadyRead( int msecs )
+{
+  const auto start = std::chrono::steady_clock::now();
+  while ( !finished ) {
+    if ( grown() ) return true;
+    if ( 0 <= msecs && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds( msecs ) ) {
+      return false;
+    }
+    std::this_thread::sleep_for( std::chrono::milliseconds( interval ) );
+  }
+  return grown();
+}
+
+
+qint64 FollowDevice::readData( char* data, qint64 maxlen )
+{
+  const qint64 got = file.read( data, maxlen );
+  if ( got < 0 ) setErrorString( file.errorString() );
+  return got;
+}
+
+
+bool FollowDevice::grown() const
+{
+  return file.pos() < file.size();
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef followdevice_h
+#define followdevice_h
+
+#include <atomic>
+
+#include <QtCore>
+
+//!
+//! Sequential read-only device of a file that is being appended to.
+//! At the end of the file reads wait for more data, as 'tail -f' does,
+//! until finish() is called. Then the device ends at the end of file.
+//!
+class FollowDevice : public QIODevice {
+public:
+  //! 'interval' is the time in ms between checks of the file size
+  explicit FollowDevice( const QString& filename, int interval = 200 );
+
+  bool open( OpenMode mode = ReadOnly ) override;
+  void close() override;
+  bool isSequential() const override { return true; }
+  bool atEnd() const override;
+  bool waitForReadyRead( int msecs ) override;
+
+  //! Stop waiting for more data. May be called from any thread.
+  void finish() { finished = true; }
+
+protected:
+  qint64 readData( char* data, qint64 maxlen ) override;
+  qint64 writeData( const char*, qint64 ) override { return -1; }
+
+private:
+  //! True, if the file has data after the read position
+  bool grown() const;
+
+  QFile file;
+  int interval;
+  std::atomic<bool> finished {false};
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "HotspotIndex.h"
+
+namespace {
+
+// Layout of the index file (native byte order):
+//   IndexHeader
+//   Range[ntypes]
+//   Hotspot[nspots]
+//   blob of NUL-terminated type names
+const char          magic[8] {'O','L','A','P','I','D','X','\0'};
+const std::uint32_t version  {1};
+
+struct IndexHeader {
+  char          magic[8];
+  std::uint32_t version;
+  std::uint32_t ntypes;
+  std::uint64_t nspots;
+  std::uint64_t blobsize;
+};
+
+static_assert( sizeof(IndexHeader) == 32, "unexpected index header layout" );
+static_assert( sizeof(Hotspot) == 56, "unexpected index cluster layout" );
+
+// ranges up to this size are scanned, not split
+constexpr size_t leaf {8};
+
+double coord( const Point& p, int axis )
+{
+  return 0 == axis ? p.x : ( 1 == axis ? p.y : p.z );
+}
+
+double distance( const Point& lhs, const Point& rhs )
+{
+  const auto d = lhs - rhs;
+  return std::sqrt( dot( d, d ) );
+}
+
+} // namespace
+
+
+HotspotIndex::HotspotIndex( std::vector<Hotspot> spots, std::vector<std::string> types, std::vector<int> cats )
+  : all{std::move( spots )}, names{std::move( types )}
+{
+  std::stable_sort( all.begin(), all.end(),
+                    []( const Hotspot& l, const Hotspot& r ) { return l.type < r.type; } );
+  ranges.resize( names.size() );
+  size_t first {};
+  for ( size_t t {}; t < names.size(); ++t ) {
+    size_t last = first;
+    while ( last < all.size() && all[last].type == t ) ++last;
+    ranges[t] = Range{ first, last - first, t < cats.size() ? cats[t] : 0, 0 };
+    build( first, last, 0 );
+    first = last;
+  }
+}
+
+
+//!
+//! Order spots[lo,hi) into a k-d tree: the median on 'axis' is in the
+//! middle, smaller values before and larger after it, split on the next axis.
+//!
+void HotspotIndex::build( size_t lo, size_t hi, int axis )
+{
+  while ( leaf < hi - lo ) {
+    const size_t mid = lo + (hi - lo) / 2;
+    std::nth_element( all.begin() + lo, all.begin() + mid, all.begin() + hi,
+                      [axis]( const Hotspot& l, const Hotspot& r ) {
+                        return coord( l.pos, axis ) < coord( r.pos, axis );
+                      } );
+    axis = (axis + 1) % 3;
+    build( lo, mid, axis );
+    lo = mid + 1;
+  }
+}
+
+
+bool HotspotIndex::save( const std::string& filename ) const
+{
+  std::string blob;
+  for ( const auto& name : names ) {
+    blob += name;
+    blob += '\0';
+  }
+
+  IndexHeader head;
+  std::memcpy( head.magic, magic, sizeof(magic) );
+  head.version  = version;
+  head.ntypes   = names.size();
+  head.nspots   = all.size();
+  head.blobsize = blob.size();
+
+  // replace the file only when complete
+  const std::string temp = filename + ".tmp";
+  {
+    std::ofstream out( temp, std::ios::binary | std::ios::trunc );
+    out.write( reinterpret_cast<const char*>( &head ), sizeof(head) );
+    out.write( reinterpret_cast<const char*>( ranges.data() ), ranges.size() * sizeof(Range) );
+    out.write( reinterpret_cast<const char*>( all.data() ), all.size() * sizeof(Hotspot) );
+    out.write( blob.data(), blob.size() );
+    out.close();
+    if ( !out ) {
+      std::remove( temp.c_str() );
+      return false;
+    }
+  }
+  return 0 == std::rename( temp.c_str(), filename.c_str() );
+}
+
+
+bool HotspotIndex::load( const std::string& filename )
+{
+  std::ifstream in( filename, std::ios::binary );
+  if ( !in ) return false;
+  const std::vector<char> data( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+  if ( data.size() < sizeof(IndexHeader) ) return false;
+
+  IndexHeader head;
+  std::memcpy( &head, data.data(), sizeof(head) );
+  if ( std::memcmp( head.magic, magic, sizeof(magic) ) || head.version != version ) return false;
+  const std::uint64_t rangebytes = std::uint64_t( head.ntypes ) * sizeof(Range);
+  const std::uint64_t spotbytes  = head.nspots * sizeof(Hotspot);
+  if ( data.size() != sizeof(IndexHeader) + rangebytes + spotbytes + head.blobsize ) return false;
+
+  const char* p = data.data() + sizeof(IndexHeader);
+  ranges.resize( head.ntypes );
+  std::memcpy( ranges.data(), p, rangebytes );
+  all.resize( head.nspots );
+  std::memcpy( all.data(), p + rangebytes, spotbytes );
+
+  names.clear();
+  const char* blob = p + rangebytes + spotbytes;
+  const char* end = blob + head.blobsize;
+  while ( blob < end && names.size() < head.ntypes ) {
+    const char* nul = std::find( blob, end, '\0' );
+    names.emplace_back( blob, nul );
+    blob = nul + 1;
+  }
+
+  // the ranges must cover the spots of their type
+  bool valid = names.size() == head.ntypes;
+  std::uint64_t first {};
+  for ( size_t t {}; valid && t < ranges.size(); ++t ) {
+    valid = ranges[t].first == first && ranges[t].count <= all.size() - first;
+    for ( auto s = first; valid && s < first + ranges[t].count; ++s ) valid = all[s].type == t;
+    first += ranges[t].count;
+  }
+  if ( !valid || first != all.size() ) {
+    all.clear();
+    names.clear();
+    ranges.clear();
+    return false;
+  }
+  return true;
+}
+
+
+bool HotspotIndex::accepts( size_t type, const Filter& filter ) const
+{
+  if ( !filter.type.empty() ) return names[type] == filter.type;
+  return filter.cat < 0 || ranges[type].cat == filter.cat;
+}
+
+
+void HotspotIndex::radius( const Point& q, double r, const Filter& filter, std::vector<Hit>& hits ) const
+{
+  hits.clear();
+  for ( size_t t {}; t < ranges.size(); ++t ) {
+    if ( accepts( t, filter ) ) radius( ranges[t].first, ranges[t].first + ranges[t].count, 0, q, r, hits );
+  }
+  std::sort( hits.begin(), hits.end() );
+}
+
+
+void HotspotIndex::radius( size_t lo, size_t hi, int axis, const Point& q, double r,
+                           std::vector<Hit>& hits ) const
+{
+  while ( leaf < hi - lo ) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const double dist = distance( all[mid].pos, q );
+    if ( dist <= r ) hits.push_back( Hit{ dist, mid } );
+    // before mid are values up to its, after mid values from its
+    const double d = coord( q, axis ) - coord( all[mid].pos, axis );
+    axis = (axis + 1) % 3;
+    if ( d <= r && -r <= d ) {
+      radius( lo, mid, axis, q, r, hits );
+      lo = mid + 1;
+    }
+    else if ( r < d ) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  for ( size_t s = lo; s < hi; ++s ) {
+    const double dist = distance( all[s].pos, q );
+    if ( dist <= r ) hits.push_back( Hit{ dist, s } );
+  }
+}
+
+
+void HotspotIndex::nearest( const Point& q, size_t k, const Filter& filter, std::vector<Hit>& hits,
+                            double maxdist ) const
+{
+  // max-heap of the best hits so far
+  hits.clear();
+  if ( 0 == k ) return;
+  for ( size_t t {}; t < ranges.size(); ++t ) {
+    if ( accepts( t, filter ) ) {
+      nearest( ranges[t].first, ranges[t].first + ranges[t].count, 0, q, k, maxdist, hits );
+    }
+  }
+  std::sort_heap( hits.begin(), hits.end() );
+}
+
+
+void HotspotIndex::nearest( size_t lo, size_t hi, int axis, const Point& q, size_t k, double maxdist,
+                            std::vector<Hit>& heap ) const
+{
+  auto offer = [&]( size_t s ) {
+    const Hit hit { distance( all[s].pos, q ), s };
+    if ( maxdist < hit.dist ) return;
+    if ( heap.size() < k ) {
+      heap.push_back( hit );
+      std::push_heap( heap.begin(), heap.end() );
+    }
+    else if ( hit < heap.front() ) {
+      std::pop_heap( heap.begin(), heap.end() );
+      heap.back() = hit;
+      std::push_heap( heap.begin(), heap.end() );
+    }
+  };
+  auto bound = [&]() { return heap.size() < k ? maxdist : heap.front().dist; };
+
+  while ( leaf < hi - lo ) {
+    const size_t mid = lo + (hi - lo) / 2;
+    offer( mid );
+    const double d = coord( q, axis ) - coord( all[mid].pos, axis );
+    axis = (axis + 1) % 3;
+    // the side of the query first, the other side if it can be nearer
+    if ( d < 0 ) {
+      nearest( lo, mid, axis, q, k, maxdist, heap );
+      if ( bound() < -d ) return;
+      lo = mid + 1;
+    }
+    else {
+      nearest( mid + 1, hi, axis, q, k, maxdist, heap );
+      if ( bound() < d ) return;
+      hi = mid;
+    }
+  }
+  for ( size_t s = lo; s < hi; ++s ) offer( s );
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef hotspotindex_h
+#define hotspotindex_h
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "Point.h"
+
+//!
+//! Cluster of an output model, as stored in a HotspotIndex
+//!
+struct Hotspot {
+  Point         pos;        // centroid
+  double        charge {};
+  std::uint64_t count {};   // members
+  std::uint32_t molecule {};
+  std::uint32_t serial {};  // atom number in the model
+  std::uint32_t type {};    // index to HotspotIndex::types()
+  std::uint32_t pad {};
+};
+
+//!
+//! Spatial index of clusters for radius and nearest neighbor queries.
+//! Clusters of each type form a k-d tree that is stored implicitly in
+//! the order of the clusters, so the index is saved and loaded as flat
+//! arrays. Does not depend on Qt, so that other programs can use it.
+//!
+class HotspotIndex {
+public:
+  //! Result of a query: position in spots() and distance to the query
+  struct Hit {
+    double dist;
+    size_t spot;
+    bool operator< ( const Hit& rhs ) const
+    { return dist < rhs.dist || ( dist == rhs.dist && spot < rhs.spot ); }
+  };
+
+  //! Clusters that a query considers: of 'type', or of category 'cat',
+  //! when 'type' is empty. Empty 'type' and negative 'cat' is all.
+  struct Filter {
+    std::string type;
+    int cat {-1};
+  };
+
+  HotspotIndex() = default;
+
+  //! Index of 'spots'; 'types' and their categories 'cats' are parallel
+  HotspotIndex( std::vector<Hotspot> spots, std::vector<std::string> types, std::vector<int> cats );
+
+  bool save( const std::string& filename ) const;
+  bool load( const std::string& filename );
+
+  const std::vector<Hotspot>& spots() const { return all; }
+  const std::vector<std::string>& types() const { return names; }
+
+  //! Clusters within 'r' of 'q', nearest first
+  void radius( const Point& q, double r, const Filter& filter, std::vector<Hit>& hits ) const;
+
+  //! At most 'k' nearest clusters within 'maxdist' of 'q', nearest first
+  void nearest( const Point& q, size_t k, const Filter& filter, std::vector<Hit>& hits,
+                double maxdist = std::numeric_limits<double>::infinity() ) const;
+
+private:
+  struct Range {
+    std::uint64_t first;
+    std::uint64_t count;
+    std::int32_t  cat;
+    std::uint32_t pad;
+  };
+
+  bool accepts( size_t type, const Filter& filter ) const;
+  void build( size_t lo, size_t hi, int axis );
+  void radius( size_t lo, size_t hi, int axis, const Point& q, double r, std::vector<Hit>& hits ) const;
+  void nearest( size_t lo, size_t hi, int axis, const Point& q, size_t k, double maxdist,
+                std::vector<Hit>& heap ) const;
+
+  std::vector<Hotspot> all;
+  std::vector<std::string> names;
+  std::vector<Range> ranges;   // of each type
+};
+
+#endif
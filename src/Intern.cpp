@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "Intern.h"
+
+namespace {
+
+struct Pool {
+  std::mutex lock;
+  std::deque<std::string> keys; // stable storage for the views in table
+  std::unordered_map<std::string_view,QString> table;
+};
+
+Pool& pool()
+{
+  static Pool instance;
+  return instance;
+}
+
+} // namespace
+
+
+QString intern( std::string_view str )
+{
+  auto& p = pool();
+  std::lock_guard<std::mutex> guard( p.lock );
+  auto it = p.table.find( str );
+  if ( it == p.table.end() ) {
+    p.keys.emplace_back( str );
+    it = p.table.emplace( p.keys.back(),
+                          QString::fromUtf8( str.data(), int(str.size()) ) ).first;
+  }
+  return it->second;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef intern_h
+#define intern_h
+
+#include <string_view>
+
+#include <QString>
+
+//!
+//! Shared copy of string. All calls with equal text return copies of
+//! the same QString, so atom names and types of a model allocate their
+//! text only once. Lookup does not allocate. Thread-safe.
+//!
+QString intern( std::string_view str );
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <limits>
+#include <cstring>
+#include <iostream>
+
+#include "ModelCache.h"
+#include "Intern.h"
+
+namespace {
+
+// Layout of the cache file (native byte order):
+//   CacheHeader
+//   CacheMol[nmols]
+//   CacheAtom[natoms]
+//   quint32[nstrings] offsets of strings in blob, padded to 8 bytes
+//   blob of NUL-terminated strings
+// Atoms refer to strings by index. Each distinct string is stored once,
+// so names and types are interned already in the file.
+const char     magic[8] {'O','L','A','P','M','D','L','\0'};
+const quint32  version  {2};
+
+struct CacheHeader {
+  char    magic[8];
+  quint32 version;
+  quint32 nstrings;
+  quint64 srcsize;
+  quint64 srchash;
+  quint64 nmols;
+  quint64 natoms;
+  quint64 blobsize;
+};
+
+struct CacheMol {
+  quint64 first;
+  quint64 count;
+  quint32 name;
+  quint32 pad;
+};
+
+struct CacheAtom {
+  double  x, y, z;
+  double  charge;
+  quint64 serial;
+  quint32 name;
+  quint32 type;
+  quint32 substid;
+  quint32 substname;
+  quint32 status;
+  qint32  fields;
+};
+
+static_assert( sizeof(CacheHeader) == 56, "unexpected cache header layout" );
+static_assert( sizeof(CacheMol) == 24, "unexpected cache molecule layout" );
+static_assert( sizeof(CacheAtom) == 64, "unexpected cache atom layout" );
+
+quint64 padded( quint64 bytes )
+{
+  return (bytes + 7) & ~quint64(7);
+}
+
+// FNV-1a, 64-bit
+quint64 fnv1a( const uchar* data, quint64 size, quint64 hash = 14695981039346656037ULL )
+{
+  for ( quint64 i {}; i < size; ++i ) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+//!
+//! Distinct strings and their text
+//!
+class Strings {
+public:
+  quint32 add( const QString& str )
+  {
+    auto it = index.find( str );
+    if ( it != index.end() ) return it->second;
+    const quint32 idx = offsets.size();
+    offsets.push_back( blob.size() );
+    auto bytes = str.toUtf8();
+    blob.insert( blob.end(), bytes.constData(), bytes.constData() + bytes.size() );
+    blob.push_back( '\0' );
+    index.emplace( str, idx );
+    return idx;
+  }
+
+  std::map<QString,quint32> index;
+  std::vector<quint32> offsets;
+  std::vector<char> blob;
+};
+
+} // namespace
+
+
+//!
+//! Checksum of file content. Size of file is returned in 'size'.
+//!
+quint64 checksum( const QString& filename, quint64& size )
+{
+  size = 0;
+  QFile file( filename );
+  if ( !file.open( QIODevice::ReadOnly ) ) return 0;
+  size = file.size();
+  if ( 0 == size ) return fnv1a( nullptr, 0 );
+
+  if ( auto data = file.map( 0, size ) ) {
+    const auto hash = fnv1a( data, size );
+    file.unmap( data );
+    return hash;
+  }
+
+  // mapping not possible: read in chunks
+  quint64 hash = fnv1a( nullptr, 0 );
+  while ( !file.atEnd() ) {
+    const auto chunk = file.read( 1 << 20 );
+    hash = fnv1a( reinterpret_cast<const uchar*>( chunk.constData() ), chunk.size(), hash );
+  }
+  return hash;
+}
+
+
+//!
+//! Read molecules from 'cachefile'. Returns false, if cache does not exist,
+//! is not valid, or was not created from current content of 'source'.
+//! Every count, index and string of the cache is checked before use.
+//!
+bool loadcache( const QString& cachefile, const QString& source, std::vector<Molecule>& mols )
+{
+  QFile file( cachefile );
+  if ( !file.open( QIODevice::ReadOnly ) ) return false;
+  const quint64 size = file.size();
+  if ( size < sizeof(CacheHeader) ) return false;
+
+  const uchar* data = file.map( 0, size );
+  if ( nullptr == data ) return false;
+
+  CacheHeader head;
+  std::memcpy( &head, data, sizeof(head) );
+  if ( std::memcmp( head.magic, magic, sizeof(magic) ) || head.version != version ) {
+    file.unmap( const_cast<uchar*>( data ) );
+    return false;
+  }
+
+  // counts are checked one by one, so that the sizes below can't overflow
+  const quint64 body = size - sizeof(CacheHeader);
+  if ( head.nmols > body / sizeof(CacheMol) || head.natoms > body / sizeof(CacheAtom)
+       || head.nstrings > body / sizeof(quint32) || head.blobsize > body ) {
+    file.unmap( const_cast<uchar*>( data ) );
+    return false;
+  }
+  const quint64 molbytes  = head.nmols * sizeof(CacheMol);
+  const quint64 atombytes = head.natoms * sizeof(CacheAtom);
+  const quint64 strbytes  = padded( head.nstrings * sizeof(quint32) );
+  if ( size != sizeof(CacheHeader) + molbytes + atombytes + strbytes + head.blobsize ) {
+    file.unmap( const_cast<uchar*>( data ) );
+    return false;
+  }
+
+  quint64 srcsize {};
+  const quint64 srchash = checksum( source, srcsize );
+  if ( srcsize != head.srcsize || srchash != head.srchash ) {
+    file.unmap( const_cast<uchar*>( data ) );
+    return false;
+  }
+
+  const auto cmols    = reinterpret_cast<const CacheMol*>( data + sizeof(CacheHeader) );
+  const auto catoms   = reinterpret_cast<const CacheAtom*>( data + sizeof(CacheHeader) + molbytes );
+  const auto coffsets = reinterpret_cast<const quint32*>( data + sizeof(CacheHeader) + molbytes + atombytes );
+  const auto blob     = reinterpret_cast<const char*>( data + sizeof(CacheHeader) + molbytes + atombytes + strbytes );
+
+  // a corrupt cache is rejected before anything is read through it
+  bool valid {true};
+  std::vector<QString> strings;
+  strings.reserve( head.nstrings );
+  for ( quint32 t {}; valid && t < head.nstrings; ++t ) {
+    const char* text = coffsets[t] < head.blobsize ? blob + coffsets[t] : nullptr;
+    const void* nul = text ? std::memchr( text, '\0', head.blobsize - coffsets[t] ) : nullptr;
+    valid = nullptr != nul;
+    if ( valid ) strings.push_back( intern( std::string_view( text, static_cast<const char*>( nul ) - text ) ) );
+  }
+  for ( quint64 m {}; valid && m < head.nmols; ++m ) {
+    valid = cmols[m].name < head.nstrings && cmols[m].first <= head.natoms
+      && cmols[m].count <= head.natoms - cmols[m].first;
+  }
+  for ( quint64 a {}; valid && a < head.natoms; ++a ) {
+    const auto& ca = catoms[a];
+    valid = ca.name < head.nstrings && ca.type < head.nstrings && ca.substid < head.nstrings
+      && ca.substname < head.nstrings && ca.status < head.nstrings;
+  }
+  if ( !valid ) {
+    file.unmap( const_cast<uchar*>( data ) );
+    return false;
+  }
+
+  mols.clear();
+  mols.reserve( head.nmols );
+  for ( quint64 m {}; m < head.nmols; ++m ) {
+    std::vector<Mol2Atom> atoms;
+    atoms.reserve( cmols[m].count );
+    for ( quint64 a = cmols[m].first; a < cmols[m].first + cmols[m].count; ++a ) {
+      const auto& ca = catoms[a];
+      Mol2Atom atom;
+      atom.serial    = ca.serial;
+      atom.name      = strings[ ca.name ];
+      atom.pos       = Point{ ca.x, ca.y, ca.z };
+      atom.type      = strings[ ca.type ];
+      atom.substid   = strings[ ca.substid ];
+      atom.substname = strings[ ca.substname ];
+      atom.charge    = ca.charge;
+      atom.status    = strings[ ca.status ];
+      atom.fields    = ca.fields;
+      atoms.push_back( std::move( atom ) );
+    }
+    mols.emplace_back( strings[ cmols[m].name ], std::move( atoms ),
+                       std::vector<QString>(), std::vector<QString>() );
+  }
+
+  file.unmap( const_cast<uchar*>( data ) );
+  return true;
+}
+
+
+//!
+//! Write atoms of molecules into 'cachefile'. Bonds and substructures
+//! are not stored, because they are not used in clustering.
+//!
+bool savecache( const QString& cachefile, const QString& source, const std::vector<Molecule>& mols )
+{
+  CacheHeader head;
+  std::memcpy( head.magic, magic, sizeof(magic) );
+  head.version = version;
+  head.srchash = checksum( source, head.srcsize );
+
+  Strings strings;
+  std::vector<CacheMol> cmols;
+  std::vector<CacheAtom> catoms;
+  cmols.reserve( mols.size() );
+  for ( const auto& mol : mols ) {
+    CacheMol cm {};
+    cm.first = catoms.size();
+    cm.name  = strings.add( mol.name );
+    for ( const auto& atom : mol.atoms ) {
+      CacheAtom ca {};
+      ca.x         = atom.pos.x;
+      ca.y         = atom.pos.y;
+      ca.z         = atom.pos.z;
+      ca.charge    = atom.charge;
+      ca.serial    = atom.serial;
+      ca.name      = strings.add( atom.name );
+      ca.type      = strings.add( atom.type );
+      ca.substid   = strings.add( atom.substid );
+      ca.substname = strings.add( atom.substname );
+      ca.status    = strings.add( atom.status );
+      ca.fields    = atom.fields;
+      catoms.push_back( ca );
+    }
+    cm.count = catoms.size() - cm.first;
+    cmols.push_back( cm );
+  }
+
+  if ( strings.blob.size() > std::numeric_limits<quint32>::max() ) {
+    std::cerr << "# Note: model is too large to cache\n";
+    return false;
+  }
+
+  head.nstrings = strings.offsets.size();
+  head.nmols    = cmols.size();
+  head.natoms   = catoms.size();
+  head.blobsize = strings.blob.size();
+  auto offsets = strings.offsets;
+  offsets.resize( padded( offsets.size() * sizeof(quint32) ) / sizeof(quint32), 0 );
+
+  QSaveFile file( cachefile );
+  if ( !file.open( QIODevice::WriteOnly ) ) return false;
+  file.write( reinterpret_cast<const char*>( &head ), sizeof(head) );
+  file.write( reinterpret_cast<const char*>( cmols.data() ), cmols.size() * sizeof(CacheMol) );
+  file.write( reinterpret_cast<const char*>( catoms.data() ), catoms.size() * sizeof(CacheAtom) );
+  file.write( reinterpret_cast<const char*>( offsets.data() ), offsets.size() * sizeof(quint32) );
+  file.write( strings.blob.data(), strings.blob.size() );
+  return file.commit();
+}
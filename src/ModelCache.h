@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef modelcache_h
+#define modelcache_h
+
+#include <vector>
+
+#include <QtCore>
+
+#include "Mol2Read.h"
+
+//!
+//! Binary cache of a parsed mol2 model.
+//!
+//! The cache is a single file that is memory mapped on load. It records
+//! the size and a checksum of the source model and is ignored when those
+//! no longer match.
+//!
+quint64 checksum( const QString& filename, quint64& size );
+
+bool loadcache( const QString& cachefile, const QString& source, std::vector<Molecule>& mols );
+
+bool savecache( const QString& cachefile, const QString& source, const std::vector<Molecule>& mols );
+
+#endif
@@ -18,12 +18,36 @@
 /*****************************************************************************
  * Includes
  ****************************************************************************/
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <iostream>
+#include <iomanip>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
 
 #include <QtCore>
 
 #include "Mol2Read.h"
+#include "Intern.h"
+
+std::ostream& write( std::ostream& out, const Mol2Atom& atom, unsigned long num )
+{
+  out << num;
+  if ( 1 < atom.fields ) out << ' ' << qPrintable(atom.name);
+  if ( 4 < atom.fields ) {
+    out << std::fixed << std::setprecision(4)
+        << ' ' << atom.pos.x << ' ' << atom.pos.y << ' ' << atom.pos.z;
+  }
+  if ( 5 < atom.fields ) out << ' ' << qPrintable(atom.type);
+  if ( 6 < atom.fields ) out << ' ' << qPrintable(atom.substid);
+  if ( 7 < atom.fields ) out << ' ' << qPrintable(atom.substname);
+  if ( 8 < atom.fields ) out << ' ' << std::setprecision(4) << atom.charge;
+  if ( 9 < atom.fields ) out << ' ' << qPrintable(atom.status);
+  return out;
+}
 
 std::ostream& operator<< ( std::ostream& out, const Molecule& mol )
 {
@@ -44,220 +68,347 @@ std::ostream& operator<< ( std::ostream& out, const Molecule& mol )
 
     out << "@<TRIPOS>ATOM\n";
     unsigned long num {0};
-    for ( auto atom : mol.atoms ) {
-      atom.front() = QString::number( ++num );
-      out << qPrintable( atom.join(' ') ) << '\n';
+    for ( const auto& atom : mol.atoms ) {
+      write( out, atom, ++num ) << '\n';
     }
     out << '\n';
     return out;
 }
 
 
-/****************************************************************************/
-/*!
-  \param Filename - name of file to parse.
-*/
-/****************************************************************************/
-std::vector<Molecule>
-parse( QTextStream & istr )
+namespace {
+
+bool isspace( char c )
 {
-  std::vector<Molecule> result;
+  return ' ' == c || '\t' == c || '\r' == c || '\n' == c;
+}
+
+//!
+//! Reads lines from device into one reused buffer.
+//! Text after '#' and surrounding whitespace are removed.
+//!
+class LineReader
+{
+public:
+  explicit LineReader( QIODevice & input ) : input{input}, buffer(1024) {}
+
+  bool next( std::string_view & line )
+  {
+    qint64 length {0};
+    for ( ;; ) {
+      const qint64 got = input.readLine( buffer.data() + length, buffer.size() - length );
+      if ( 0 < got ) length += got;
+      if ( 0 < length && '\n' == buffer[length - 1] ) break;
+      if ( got <= 0 && ( got < 0 || input.atEnd() ) ) {
+        if ( 0 == length ) return false;
+        break;
+      }
+      if ( 0 == got ) input.waitForReadyRead( -1 );
+      if ( length + 1 >= qint64(buffer.size()) ) buffer.resize( 2 * buffer.size() );
+    }
+
+    std::string_view text( buffer.data(), length );
+    comment = false;
+    const auto hash = text.find( '#' );
+    if ( std::string_view::npos != hash ) text = text.substr( 0, hash );
+    while ( !text.empty() && isspace( text.front() ) ) text.remove_prefix( 1 );
+    while ( !text.empty() && isspace( text.back() ) ) text.remove_suffix( 1 );
+    comment = text.empty() && std::string_view::npos != hash
+      && std::string_view( buffer.data(), hash ).find_first_not_of( " \t\r" ) == std::string_view::npos;
+    line = text;
+    return true;
+  }
+
+  //! Read lines until next "@<TRIPOS>" line, which is returned in 'line'.
+  bool skip( std::string_view & line )
+  {
+    bool linestart {true};
+    for ( ;; ) {
+      const qint64 got = input.readLine( buffer.data(), buffer.size() );
+      if ( got < 0 || ( 0 == got && input.atEnd() ) ) return false;
+      if ( 0 == got ) {
+        input.waitForReadyRead( -1 );
+        continue;
+      }
+      const char* p = buffer.data();
+      const char* end = p + got;
+      const bool check = linestart;
+      linestart = '\n' == end[-1];
+      if ( ! check ) continue;
+      while ( p < end && ( ' ' == *p || '\t' == *p ) ) ++p;
+      if ( end - p >= 9 && 0 == std::memcmp( p, "@<TRIPOS>", 9 ) ) {
+        std::string_view text( p, end - p );
+        const auto hash = text.find( '#' );
+        if ( std::string_view::npos != hash ) text = text.substr( 0, hash );
+        while ( !text.empty() && isspace( text.back() ) ) text.remove_suffix( 1 );
+        line = text;
+        comment = false;
+        return true;
+      }
+    }
+  }
+
+  bool comment {false}; // line started with '#'
+
+private:
+  QIODevice & input;
+  std::vector<char> buffer;
+};
+
+bool istripos( std::string_view line, std::string_view section = std::string_view() )
+{
+  const std::string_view tag = "@<TRIPOS>";
+  if ( line.substr( 0, tag.size() ) != tag ) return false;
+  return section.empty() || line.substr( tag.size(), section.size() ) == section;
+}
+
+//!
+//! Split line into whitespace-separated words. Returns the number of words.
+//! Words beyond 'words.size()' are left in 'rest'.
+//!
+template<size_t N>
+size_t split( std::string_view line, std::array<std::string_view,N> & words, std::string_view & rest )
+{
+  size_t count {0};
+  rest = std::string_view();
+  size_t pos {0};
+  while ( pos < line.size() ) {
+    while ( pos < line.size() && isspace( line[pos] ) ) ++pos;
+    if ( pos == line.size() ) break;
+    if ( count == N ) {
+      rest = line.substr( pos );
+      size_t more {0};
+      for ( size_t p = pos; p < line.size(); ) {
+        while ( p < line.size() && isspace( line[p] ) ) ++p;
+        if ( p == line.size() ) break;
+        ++more;
+        while ( p < line.size() && !isspace( line[p] ) ) ++p;
+      }
+      return count + more;
+    }
+    const auto start = pos;
+    while ( pos < line.size() && !isspace( line[pos] ) ) ++pos;
+    words[count++] = line.substr( start, pos - start );
+  }
+  return count;
+}
+
+double todouble( std::string_view word )
+{
+  if ( !word.empty() && '+' == word.front() ) word.remove_prefix( 1 );
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  double value {};
+  std::from_chars( word.data(), word.data() + word.size(), value );
+  return value;
+#else
+  return QByteArray( word.data(), int(word.size()) ).toDouble();
+#endif
+}
+
+unsigned long toulong( std::string_view word )
+{
+  unsigned long value {};
+  std::from_chars( word.data(), word.data() + word.size(), value );
+  return value;
+}
+
+bool toatom( std::string_view line, const std::vector<std::string>& deletetypes, Mol2Atom & atom )
+{
+  std::array<std::string_view,9> w;
+  std::string_view rest;
+  atom = Mol2Atom();
+  atom.fields = split( line, w, rest );
+  const size_t n = std::min<size_t>( atom.fields, w.size() );
+  if ( 9 == atom.fields && !deletetypes.empty()
+       && std::find( deletetypes.begin(), deletetypes.end(), w[5] ) != deletetypes.end() ) {
+    return false;
+  }
+  if ( 0 < n ) atom.serial = toulong( w[0] );
+  if ( 1 < n ) atom.name = intern( w[1] );
+  if ( 4 < n ) atom.pos = Point{ todouble( w[2] ), todouble( w[3] ), todouble( w[4] ) };
+  if ( 5 < n ) atom.type = intern( w[5] );
+  if ( 6 < n ) atom.substid = intern( w[6] );
+  if ( 7 < n ) atom.substname = intern( w[7] );
+  if ( 8 < n ) atom.charge = todouble( w[8] );
+  if ( !rest.empty() ) atom.status = intern( rest );
+  return true;
+}
+
+QString simplified( std::string_view line )
+{
+  return QString::fromUtf8( line.data(), int(line.size()) ).simplified();
+}
+
+} // namespace
+
+
+//!
+//! State of Mol2Reader between molecules
+//!
+struct Mol2Reader::State
+{
+  State( QIODevice & input, const ParseOptions & options )
+    : options{options}, reader{input}
+  {
+    for ( const auto& type : options.deletetypes ) deletetypes.push_back( type.toStdString() );
+    more = reader.next( s );
+  }
+
+  //! Append the molecule read so far into 'result', if it has atoms, and reset.
+  void create( std::vector<Molecule> & result )
+  {
+    if ( 0 < Read )
+      {
+        Q_ASSERT( Atoms == Read );
+        result.emplace_back( std::move( Mol_name ), std::move( atoms ),
+                             std::move( bonds ), std::move( substructure ) );
+      }
+    Mol_name = QString();
+    atoms = std::vector<Mol2Atom>();
+    bonds = std::vector<QString>();
+    substructure = std::vector<QString>();
+    Atoms = 0;
+    Read = 0;
+  }
+
+  ParseOptions options;
+  std::vector<std::string> deletetypes;
+  LineReader reader;
+  std::string_view s;
+  bool more {false};
+
   QString              Mol_name;
   std::vector<QString> substructure;
-  std::vector<QStringList> atoms;
+  std::vector<Mol2Atom> atoms;
   std::vector<QString> bonds;
+  std::vector<Mol2Atom>::size_type Atoms = 0;
+  std::vector<Mol2Atom>::size_type Read = 0;  // including dropped atoms
+};
 
-  QString s;
-  QStringList MolNumbers;
-  unsigned long Line = 0;
-  std::vector<QString>::size_type Atoms = 0;
-  bool NextLine = true;
 
-  // Read the file
-  while ( !istr.atEnd() )
-    {        // until end of file...
-      if ( NextLine )
-        {
-          s = istr.readLine().simplified(); // line of text excluding '\n'
-          auto index = s.indexOf( '#' );
-          if ( -1 != index ) s = s.left( index ).simplified();
-        }
-      else
-        {
-          NextLine = true;
-        }
+Mol2Reader::Mol2Reader( QIODevice & input, const ParseOptions & options )
+  : d{ new State( input, options ) }
+{
+}
 
-      if ( ! s.isEmpty() )
-        {
-          if ( s.left( 17 ) == "@<TRIPOS>MOLECULE" )
-            {
-              // New molecule: create previous
-              if ( 0 < atoms.size() )
-                {
-                  Q_ASSERT( Atoms == atoms.size() );
-                  result.emplace_back( Mol_name, atoms, bonds, substructure );
-                }
+Mol2Reader::~Mol2Reader() = default;
 
-              // reset objects
-              Mol_name.clear();
-              substructure.clear();
-              atoms.clear();
-              bonds.clear();
 
-              Atoms = 0;
+/****************************************************************************/
+/*!
+  Read until the next molecule is complete and append it into 'result'.
+  When bonds and substructures are not kept, a molecule is complete at
+  the end of its ATOM section, otherwise at the next MOLECULE or end of
+  input.
+  \return false at end of input.
+*/
+/****************************************************************************/
+bool Mol2Reader::next( std::vector<Molecule> & result )
+{
+  auto& r = *d;
+  const auto before = result.size();
+  const bool atomsonly = ! r.options.bonds && ! r.options.substructures;
+  auto& reader = r.reader;
+  auto& s = r.s;
+  auto& more = r.more;
 
-              Line = 0;
-              int CommentStarts = -1;
-              while ( !istr.atEnd() )
-                {
-                  s = istr.readLine().simplified();
-                  CommentStarts = s.indexOf( '#' );
-                  if ( -1 != CommentStarts )
-                    {
-                      s = s.left( s.indexOf( '#' ) ).simplified();
-                    }
-
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  else if ( 0 != CommentStarts )
-                    {
-                      switch( Line )
-                        {
-                        case 0:
-                          Mol_name = s;
-                          if ( s.isEmpty() ) s = "Mol2";
-                          qDebug() << "Mol_name: " << s << '\n';
-                          ++Line;
-                          break;
-                        case 1:
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-                          MolNumbers = s.split( ' ', QString::SkipEmptyParts );
-#else
-                          MolNumbers = s.split( ' ', Qt::SkipEmptyParts );
-#endif
-                          Atoms = MolNumbers.first().toInt();
-                          atoms.reserve( Atoms );
-                          qDebug() << "Num_atoms: " << Atoms << '\n';
-                          ++Line;
-                          break;
-                        case 2:
-                          ++Line;
-                          break;
-                        case 3:
-                          qDebug() << "Charge_type: " << s << '\n';
-                          ++Line;
-                          break;
-                        default:
-                          break;
-                        }
-                    }
-                }
-            }
-          else if ( s.left( 13 ) == "@<TRIPOS>DICT" )
-            {
-              while ( !istr.atEnd() )
-                {
-                  s = istr.readLine().simplified();
-                  if ( -1 != s.indexOf( '#' ) ) s = s.left( s.indexOf( '#' ) ).simplified();
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  // We should do something here
-                }
-            }
-          else if ( s.left( 13 ) == "@<TRIPOS>ATOM" )
+  // Read the file
+  while ( more && result.size() == before )
+    {        // until end of file or molecule...
+      if ( istripos( s, "MOLECULE" ) )
+        {
+          // New molecule: create previous
+          r.create( result );
+
+          unsigned long Line = 0;
+          while ( ( more = reader.next( s ) ) && ! istripos( s ) )
             {
-              Line = 0;
-              while ( !istr.atEnd() )
+              if ( reader.comment ) continue;
+              switch( Line )
                 {
-                  s = istr.readLine().simplified();
-                  if ( -1 != s.indexOf( '#' ) ) s = s.left( s.indexOf( '#' ) ).simplified();
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  else if ( ! s.isEmpty() )
-                    {
-                      if ( Line < Atoms )
-                        {
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-                          auto entry = s.split( ' ', QString::SkipEmptyParts );
-#else
-                          auto entry = s.split( ' ', Qt::SkipEmptyParts );
-#endif
-                          atoms.push_back( entry );
-                          ++Line;
-                        }
-                    }
+                case 0:
+                  r.Mol_name = simplified( s );
+                  qDebug() << "Mol_name: " << r.Mol_name << '\n';
+                  ++Line;
+                  break;
+                case 1:
+                  {
+                    std::array<std::string_view,1> numbers;
+                    std::string_view rest;
+                    if ( split( s, numbers, rest ) ) r.Atoms = toulong( numbers[0] );
+                    r.atoms.reserve( r.Atoms );
+                    qDebug() << "Num_atoms: " << r.Atoms << '\n';
+                    ++Line;
+                  }
+                  break;
+                case 2:
+                  ++Line;
+                  break;
+                case 3:
+                  qDebug() << "Charge_type: " << simplified( s ) << '\n';
+                  ++Line;
+                  break;
+                default:
+                  break;
                 }
             }
-          else if ( s.left( 13 ) == "@<TRIPOS>BOND" )
+        }
+      else if ( istripos( s, "ATOM" ) )
+        {
+          Mol2Atom atom;
+          while ( ( more = reader.next( s ) ) && ! istripos( s ) )
             {
-              Line = 0;
-              while ( !istr.atEnd() )
+              if ( ! s.empty() && r.Read < r.Atoms )
                 {
-                  s = istr.readLine().simplified();
-                  if ( -1 != s.indexOf( '#' ) ) s = s.left( s.indexOf( '#' ) ).simplified();
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  else if ( ! s.isEmpty() )
-                    {
-                      bonds.push_back( s );
-                      ++Line;
-                    }
+                  ++r.Read;
+                  if ( toatom( s, r.deletetypes, atom ) ) r.atoms.push_back( std::move( atom ) );
                 }
             }
-          else if ( s.left( 21 ) == "@<TRIPOS>SUBSTRUCTURE" )
+          // nothing else is kept: do not wait for the rest of the molecule
+          if ( atomsonly && r.Read == r.Atoms ) r.create( result );
+        }
+      else if ( istripos( s, "BOND" ) && r.options.bonds )
+        {
+          while ( ( more = reader.next( s ) ) && ! istripos( s ) )
             {
-              Line = 0;
-              while ( !istr.atEnd() )
-                {
-                  s = istr.readLine().simplified();
-                  if ( -1 != s.indexOf( '#' ) ) s = s.left( s.indexOf( '#' ) ).simplified();
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  else if ( ! s.isEmpty() )
-                    {
-                      substructure.push_back( s );
-                      ++Line;
-                    }
-                }
+              if ( ! s.empty() ) r.bonds.push_back( simplified( s ) );
             }
-          else if ( s.left( 12 ) == "@<TRIPOS>SET" )
+        }
+      else if ( istripos( s, "SUBSTRUCTURE" ) && r.options.substructures )
+        {
+          while ( ( more = reader.next( s ) ) && ! istripos( s ) )
             {
-              while ( !istr.atEnd() )
-                {
-                  s = istr.readLine().simplified();
-                  if ( -1 != s.indexOf( '#' ) ) s = s.left( s.indexOf( '#' ) ).simplified();
-                  if ( s.left( 9 ) == "@<TRIPOS>" )
-                    {
-                      NextLine = false;
-                      break;
-                    }
-                  // We should do something here
-                }
+              if ( ! s.empty() ) r.substructure.push_back( simplified( s ) );
             }
         }
+      else if ( istripos( s ) )
+        {
+          // DICT, SET, etc. are not used
+          more = reader.skip( s );
+        }
+      else
+        {
+          more = reader.next( s );
+        }
     }
 
   // Create last molecule
-  Q_ASSERT( Atoms == atoms.size() );
-  if ( ! atoms.empty() )
-    {
-      result.emplace_back( Mol_name, atoms, bonds, substructure );
-    }
+  if ( ! more && result.size() == before ) r.create( result );
 
+  return result.size() > before;
+}
+
+
+/****************************************************************************/
+/*!
+  \param input - device to parse.
+*/
+/****************************************************************************/
+std::vector<Molecule>
+parse( QIODevice & input, const ParseOptions & options )
+{
+  std::vector<Molecule> result;
+  Mol2Reader reader( input, options );
+  while ( reader.next( result ) ) {}
   return result;
 }
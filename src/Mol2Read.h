@@ -19,25 +19,82 @@
 #define mol2read_h
 
 #include <vector>
+#include <memory>
 #include <iosfwd>
 
 #include <QtCore>
 
+#include "Point.h"
+
+//!
+//! Atom record of a mol2 file. The strings are interned (see Intern.h),
+//! so a record owns no text of its own.
+//!
+struct Mol2Atom
+{
+  unsigned long serial {};
+  QString name;
+  Point   pos;
+  QString type;
+  QString substid;
+  QString substname;
+  double  charge {};
+  QString status;      // fields after charge, if any
+  int     fields {};   // number of fields in the record
+};
+
 struct Molecule
 {
   QString              name;
-  std::vector<QStringList> atoms;
+  std::vector<Mol2Atom> atoms;
   std::vector<QString> bonds;
   std::vector<QString> substructures;
 
-  Molecule( const QString& n, const std::vector<QStringList> & a,
-            const std::vector<QString> & b, const std::vector<QString> & s )
-    : name(n), atoms(a), bonds(b), substructures(s)
+  Molecule( QString n, std::vector<Mol2Atom> && a,
+            std::vector<QString> && b, std::vector<QString> && s )
+    : name(std::move(n)), atoms(std::move(a)), bonds(std::move(b)), substructures(std::move(s))
   { }
+
+  Molecule( Molecule && ) = default;
+  Molecule& operator= ( Molecule && ) = default;
+  Molecule( const Molecule & ) = delete;
+  Molecule& operator= ( const Molecule & ) = delete;
+};
+
+//!
+//! What parse() keeps. Bodies of sections that are not kept are skipped
+//! without tokenizing. Atoms of 'deletetypes' are dropped before a
+//! record is created for them.
+//!
+struct ParseOptions
+{
+  bool bonds {true};
+  bool substructures {true};
+  QStringList deletetypes;
 };
 
+std::ostream& write( std::ostream& out, const Mol2Atom& atom, unsigned long num );
+
 std::ostream& operator<< ( std::ostream& out, const Molecule& mol );
 
-std::vector<Molecule> parse( QTextStream & istr );
+//!
+//! Parser that returns molecules one at a time, as soon as each is
+//! complete, so that input from a pipe can be processed while it is
+//! being written.
+//!
+class Mol2Reader
+{
+public:
+  explicit Mol2Reader( QIODevice & input, const ParseOptions & options = ParseOptions() );
+  ~Mol2Reader();
+
+  bool next( std::vector<Molecule> & result );
+
+private:
+  struct State;
+  std::unique_ptr<State> d;
+};
+
+std::vector<Molecule> parse( QIODevice & input, const ParseOptions & options = ParseOptions() );
 
 #endif
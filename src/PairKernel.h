@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef pairkernel_h
+#define pairkernel_h
+
+#include <vector>
+#include <utility>
+#include <cmath>
+
+//!
+//! Atoms of a bin as arrays for the pair loops. Type compatibility is
+//! resolved into 'key' beforehand: two atoms are of same type (see
+//! sametype()) when their keys are equal and charges are close enough.
+//!
+struct PairData {
+  std::vector<double> x, y, z;
+  std::vector<double> charge;
+  std::vector<int>    key;
+  std::vector<unsigned char> mono;
+  bool allmono {true};
+  bool chargetest {true};  // false, when no two charges differ more than chargediff
+
+  size_t size() const { return x.size(); }
+
+  void clear()
+  {
+    x.clear(); y.clear(); z.clear();
+    charge.clear(); key.clear(); mono.clear();
+    allmono = true;
+    chargetest = true;
+  }
+};
+
+
+//!
+//! Distances from 'row' to atoms 'cand' that are of same type.
+//! Single atoms are twice as far from each other as they are.
+//! Distances are written into out[col].
+//!
+template<bool ChargeTest, bool AllMono>
+void distancerow( const PairData& d, size_t row, const std::vector<size_t>& cand,
+                  double chargediff, double* out )
+{
+  const int key = d.key[row];
+  const double q = d.charge[row];
+  const double x = d.x[row];
+  const double y = d.y[row];
+  const double z = d.z[row];
+  const unsigned char mono = d.mono[row];
+  for ( const auto col : cand ) {
+    if ( key != d.key[col] ) continue;
+    if ( ChargeTest && chargediff < std::abs( q - d.charge[col] ) ) continue;
+    const double dx = x - d.x[col];
+    const double dy = y - d.y[col];
+    const double dz = z - d.z[col];
+    double dist = std::sqrt( dx * dx + dy * dy + dz * dz );
+    if ( AllMono ) dist *= 2;
+    else dist *= 1 + (mono & d.mono[col]);
+    out[col] = dist;
+  }
+}
+
+using DistanceKernel = void (*)( const PairData&, size_t, const std::vector<size_t>&, double, double* );
+
+inline DistanceKernel distancekernel( const PairData& d )
+{
+  if ( d.chargetest ) {
+    return d.allmono ? distancerow<true,true> : distancerow<true,false>;
+  }
+  return d.allmono ? distancerow<false,true> : distancerow<false,false>;
+}
+
+
+//!
+//! Atoms 'cand' that are of same type as 'row' and closer than sqrt(maxdist).
+//! Appends (col, maxdist - squared distance) into 'out'.
+//!
+template<bool ChargeTest>
+void edgerow( const PairData& d, size_t row, const std::vector<size_t>& cand,
+              double chargediff, double maxdist, std::vector<std::pair<size_t,double>>& out )
+{
+  const int key = d.key[row];
+  const double q = d.charge[row];
+  const double x = d.x[row];
+  const double y = d.y[row];
+  const double z = d.z[row];
+  for ( const auto col : cand ) {
+    if ( key != d.key[col] ) continue;
+    if ( ChargeTest && chargediff < std::abs( q - d.charge[col] ) ) continue;
+    const double dx = x - d.x[col];
+    const double dy = y - d.y[col];
+    const double dz = z - d.z[col];
+    const double s = maxdist - (dx * dx + dy * dy + dz * dz);
+    if ( 0 < s ) out.emplace_back( col, s );
+  }
+}
+
+using EdgeKernel = void (*)( const PairData&, size_t, const std::vector<size_t>&, double, double,
+                             std::vector<std::pair<size_t,double>>& );
+
+inline EdgeKernel edgekernel( const PairData& d )
+{
+  return d.chargetest ? edgerow<true> : edgerow<false>;
+}
+
+#endif
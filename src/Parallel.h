@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef parallel_h
+#define parallel_h
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//!
+//! Call f(i, worker) for i in [0,n) using up to 'threads' threads.
+//! Items are handed out in increasing order; 'worker' in [0,threads)
+//! identifies the calling thread, e.g. for per-thread buffers. No two
+//! calls with the same 'worker' run at the same time.
+//!
+template<class F>
+void parallel_for_worker( size_t n, int threads, F f )
+{
+  if ( threads < 2 || n < 2 ) {
+    for ( size_t i {}; i < n; ++i ) f( i, size_t(0) );
+    return;
+  }
+
+  std::atomic<size_t> next {0};
+  auto work = [&]( size_t worker ) {
+    for ( size_t i = next++; i < n; i = next++ ) f( i, worker );
+  };
+
+  std::vector<std::thread> pool;
+  const size_t count = std::min( size_t(threads), n );
+  for ( size_t t = 1; t < count; ++t ) pool.emplace_back( work, t );
+  work( 0 );
+  for ( auto& t : pool ) t.join();
+}
+
+//!
+//! Call f(i) for i in [0,n) using up to 'threads' threads.
+//! Items are handed out in increasing order; f must not depend
+//! on which thread calls it.
+//!
+template<class F>
+void parallel_for( size_t n, int threads, F f )
+{
+  parallel_for_worker( n, threads, [&f]( size_t i, size_t ) { f( i ); } );
+}
+
+#endif
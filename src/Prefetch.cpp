@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+
+#include "Prefetch.h"
+
+Prefetch::Prefetch( const QStringList& names, size_t threads, size_t window )
+  : files( names.size() ), ready( names.size(), 0 ), window{std::max( size_t(1), window )}
+{
+  for ( int f {}; f < names.size(); ++f ) files[f].name = names[f];
+  threads = std::min( std::max( size_t(1), threads ), files.size() );
+  for ( size_t t {}; t < threads; ++t ) workers.emplace_back( [this]() { run(); } );
+}
+
+
+Prefetch::~Prefetch()
+{
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    stop = true;
+  }
+  cond.notify_all();
+  for ( auto& worker : workers ) worker.join();
+}
+
+
+bool Prefetch::next( File& file )
+{
+  std::unique_lock<std::mutex> guard( lock );
+  if ( taken == files.size() ) return false;
+  cond.wait( guard, [this]() { return ready[taken]; } );
+  file = std::move( files[taken] );
+  ++taken;
+  guard.unlock();
+  cond.notify_all();
+  return true;
+}
+
+
+void Prefetch::run()
+{
+  for ( ;; ) {
+    size_t f {};
+    {
+      std::unique_lock<std::mutex> guard( lock );
+      cond.wait( guard, [this]() { return stop || claimed == files.size() || claimed < taken + window; } );
+      if ( stop || claimed == files.size() ) return;
+      f = claimed++;
+    }
+
+    // the slot is not touched by others until it is ready
+    auto& file = files[f];
+    QFile input( file.name );
+    if ( !input.open( QIODevice::ReadOnly ) ) {
+      file.error = input.errorString();
+    }
+    else {
+      file.content = input.read( 4 );
+      file.format = compression( file.content );
+      if ( Compression::None == file.format ) {
+        file.content.append( input.readAll() );
+        if ( QFileDevice::NoError != input.error() ) file.error = input.errorString();
+      }
+      else {
+        file.content.clear();
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      ready[f] = 1;
+    }
+    cond.notify_all();
+  }
+}
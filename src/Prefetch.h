@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef prefetch_h
+#define prefetch_h
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QtCore>
+
+#include "Compression.h"
+
+//!
+//! Content of files, read ahead into memory by a pool of threads, so that
+//! opening and reading many small files overlaps parsing. Files are handed
+//! out in the given order. At most 'window' files are held at a time.
+//! The content of a compressed file is not read; it is decompressed
+//! while it is parsed.
+//!
+class Prefetch {
+public:
+  struct File {
+    QString name;
+    QByteArray content;
+    Compression format {Compression::None};
+    QString error;   // why the file could not be read
+  };
+
+  Prefetch( const QStringList& files, size_t threads, size_t window );
+  ~Prefetch();
+
+  //! Wait for the next file and move it to 'file'.
+  //! Returns false, when all files have been handed out.
+  bool next( File& file );
+
+private:
+  void run();
+
+  std::vector<File> files;
+  std::vector<char> ready;
+  size_t window;
+  size_t claimed {};   // files given to threads
+  size_t taken {};     // files handed out by next()
+  bool stop {false};
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<std::thread> workers;
+};
+
+#endif
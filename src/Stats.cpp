@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <string>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Stats.h"
+
+namespace {
+
+struct Phases {
+  std::mutex lock;
+  std::map<std::string,std::pair<double,unsigned long>> seconds; // total and count
+  std::map<std::string,EventCounts> events;
+};
+
+Phases& phases()
+{
+  static Phases instance;
+  return instance;
+}
+
+const char* const eventnames[EventCounts::size] {
+  "cycles", "instructions", "cache-misses", "branch-misses", "page-faults"
+};
+
+std::atomic<bool> enabled {false};
+std::atomic<bool> available[EventCounts::size] {};
+std::string unavailable; // reason, when no counter could be opened
+
+#ifdef __linux__
+//!
+//! Event counters of the calling thread. Counters are read without
+//! stopping them; values are scaled, when the kernel multiplexes them.
+//!
+class ThreadCounters {
+public:
+  ThreadCounters()
+  {
+    const std::pair<unsigned,unsigned long long> events[EventCounts::size] {
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+      { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    };
+    for ( int e {}; e < EventCounts::size; ++e ) {
+      perf_event_attr attr {};
+      attr.size = sizeof(attr);
+      attr.type = events[e].first;
+      attr.config = events[e].second;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fd[e] = syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+      if ( 0 <= fd[e] ) available[e] = true;
+      else error = errno;
+    }
+  }
+
+  ~ThreadCounters()
+  {
+    for ( auto f : fd ) if ( 0 <= f ) close( f );
+  }
+
+  bool anyopen() const
+  {
+    for ( auto f : fd ) if ( 0 <= f ) return true;
+    return false;
+  }
+
+  int error {}; // of the last counter that could not be opened
+
+  void read( EventCounts& counts ) const
+  {
+    for ( int e {}; e < EventCounts::size; ++e ) {
+      unsigned long long data[3] {}; // value, time enabled, time running
+      if ( fd[e] < 0 || sizeof(data) != ::read( fd[e], data, sizeof(data) ) ) continue;
+      counts.value[e] = data[2] && data[2] < data[1]
+        ? static_cast<unsigned long long>( double( data[0] ) * data[1] / data[2] ) : data[0];
+    }
+  }
+
+private:
+  int fd[EventCounts::size] { -1, -1, -1, -1, -1 };
+};
+
+ThreadCounters& threadcounters()
+{
+  thread_local ThreadCounters instance;
+  return instance;
+}
+#endif
+
+bool readcounters( EventCounts& counts )
+{
+#ifdef __linux__
+  if ( ! enabled ) return false;
+  const auto& tc = threadcounters();
+  if ( ! tc.anyopen() ) return false;
+  tc.read( counts );
+  return true;
+#else
+  (void)counts;
+  return false;
+#endif
+}
+
+} // namespace
+
+Stats& stats()
+{
+  static Stats instance;
+  return instance;
+}
+
+bool enablecounters()
+{
+#ifdef __linux__
+  const auto& tc = threadcounters();
+  if ( tc.anyopen() ) {
+    enabled = true;
+    return true;
+  }
+  unavailable = std::strerror( tc.error );
+#else
+  unavailable = "not supported on this platform";
+#endif
+  return false;
+}
+
+PhaseTimer::PhaseTimer( const char* phase )
+  : phase{phase}
+{
+  // counters of a new thread are opened here, before the phase starts
+  counting = readcounters( events );
+  start = std::chrono::steady_clock::now();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+  EventCounts end;
+  if ( counting ) readcounters( end );
+  const std::chrono::duration<double> spent = std::chrono::steady_clock::now() - start;
+  auto& p = phases();
+  std::lock_guard<std::mutex> guard( p.lock );
+  auto& entry = p.seconds[phase];
+  entry.first += spent.count();
+  ++entry.second;
+  if ( counting ) {
+    auto& total = p.events[phase];
+    for ( int e {}; e < EventCounts::size; ++e ) total.value[e] += end.value[e] - events.value[e];
+  }
+}
+
+void report( std::ostream& out )
+{
+  const auto& s = stats();
+  const unsigned long long pairs = s.pairs;
+  const unsigned long long pruned = s.pruned;
+  out << "# Pairs tested:         " << pairs << '\n';
+  out << "# Pairs pruned by charge: " << pruned;
+  if ( 0 < pairs + pruned ) {
+    out << " (" << 100.0 * pruned / (pairs + pruned) << " %)";
+  }
+  out << '\n';
+
+  auto& p = phases();
+  std::lock_guard<std::mutex> guard( p.lock );
+  if ( ! unavailable.empty() ) {
+    out << "# Event counters not available: " << unavailable << '\n';
+  }
+  else if ( enabled ) {
+    std::string missing;
+    for ( int e {}; e < EventCounts::size; ++e ) {
+      if ( ! available[e] ) missing = missing + ' ' + eventnames[e];
+    }
+    if ( ! missing.empty() ) out << "# Event counters not available:" << missing << '\n';
+  }
+  for ( const auto& phase : p.seconds ) {
+    out << "# Time " << std::left << std::setw(16) << phase.first << std::right
+        << std::fixed << std::setprecision(3) << std::setw(12) << 1000 * phase.second.first
+        << " ms in " << phase.second.second << " calls";
+    auto ev = p.events.find( phase.first );
+    if ( ev != p.events.end() ) {
+      out << std::defaultfloat << std::setprecision(4);
+      for ( int e {}; e < EventCounts::size; ++e ) {
+        if ( available[e] ) out << ", " << double( ev->second.value[e] ) << ' ' << eventnames[e];
+      }
+    }
+    out << '\n';
+  }
+  out << std::defaultfloat;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef stats_h
+#define stats_h
+
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+
+//!
+//! Counters of work done, shown with option --stats
+//!
+struct Stats {
+  std::atomic<unsigned long long> pairs  {0}; // pairs tested for type and charge
+  std::atomic<unsigned long long> pruned {0}; // pairs never generated due to charge index
+};
+
+Stats& stats();
+
+//!
+//! Hardware and software events of a thread: cycles, instructions,
+//! cache misses, branch misses and page faults
+//!
+struct EventCounts {
+  static constexpr int size = 5;
+  unsigned long long value[size] {};
+};
+
+//!
+//! Count events of phases with perf_event_open (Linux only), shown with
+//! option --stats. Returns false, when no counter is available; the
+//! report then tells why.
+//!
+bool enablecounters();
+
+//!
+//! Adds wall time (and events, when enabled) of its lifetime to named
+//! phase, shown with option --stats
+//!
+class PhaseTimer {
+public:
+  explicit PhaseTimer( const char* phase );
+  ~PhaseTimer();
+
+private:
+  const char* phase;
+  std::chrono::steady_clock::time_point start;
+  bool counting {false};
+  EventCounts events;
+};
+
+void report( std::ostream& out );
+
+#endif
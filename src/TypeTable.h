@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2022-2023 Jukka V. Lehtonen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef typetable_h
+#define typetable_h
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+//!
+//! Value of an atom type in a compiled-in table
+//!
+template<class T>
+struct TypeValue {
+  std::string_view type;
+  T value;
+};
+
+//!
+//! FNV-1a over code units, so that 8-bit and UTF-16 strings of
+//! the same ASCII text have the same hash.
+//!
+template<class C>
+constexpr std::uint32_t typehash( const C* str, std::size_t len )
+{
+  std::uint32_t hash {2166136261u};
+  for ( std::size_t i {}; i < len; ++i ) {
+    hash ^= std::uint32_t( str[i] );
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+constexpr std::uint32_t typemix( std::uint32_t hash, std::uint32_t seed )
+{
+  hash ^= seed * 0x9e3779b9u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+constexpr std::size_t pow2above( std::size_t n )
+{
+  std::size_t p {1};
+  while ( p < n ) p *= 2;
+  return p;
+}
+
+//!
+//! Perfect hash of N distinct types, built at compile time with
+//! hash and displace: keys are grouped into buckets by one hash, and
+//! each bucket gets a seed that places all of its keys in free slots.
+//! A lookup costs two hashes and one comparison.
+//!
+template<std::size_t N>
+class TypeHash {
+public:
+  static constexpr std::size_t buckets = pow2above( N / 2 + 1 );
+  static constexpr std::size_t slots   = pow2above( 2 * N );
+
+  template<class T>
+  constexpr explicit TypeHash( const TypeValue<T> (&table)[N] )
+  {
+    std::uint32_t hashes[N] {};
+    std::size_t bucket[N] {};
+    std::size_t sizes[buckets] {};
+    for ( std::size_t k {}; k < N; ++k ) {
+      keys[k] = table[k].type;
+      hashes[k] = typehash( keys[k].data(), keys[k].size() );
+      bucket[k] = typemix( hashes[k], 0 ) & ( buckets - 1 );
+      ++sizes[bucket[k]];
+    }
+    for ( auto& s : index ) s = -1;
+
+    // place large buckets first, while there are many free slots
+    for ( std::size_t size = N; 0 < size; --size ) {
+      for ( std::size_t b {}; b < buckets; ++b ) {
+        if ( size != sizes[b] ) continue;
+        for ( std::uint32_t seed {1}; ; ++seed ) {
+          bool fits {true};
+          for ( std::size_t k {}; fits && k < N; ++k ) {
+            if ( bucket[k] != b ) continue;
+            const std::size_t slot = typemix( hashes[k], seed ) & ( slots - 1 );
+            fits = index[slot] < 0;
+            // two keys of the bucket may collide with each other
+            for ( std::size_t j {}; fits && j < k; ++j ) {
+              fits = bucket[j] != b || slot != ( typemix( hashes[j], seed ) & ( slots - 1 ) );
+            }
+          }
+          if ( !fits ) continue;
+          seeds[b] = seed;
+          for ( std::size_t k {}; k < N; ++k ) {
+            if ( bucket[k] == b ) index[typemix( hashes[k], seed ) & ( slots - 1 )] = k;
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  //! Index of type 'str' in the table, or -1
+  template<class C>
+  constexpr int find( const C* str, std::size_t len ) const
+  {
+    const std::uint32_t hash = typehash( str, len );
+    const int k = index[typemix( hash, seeds[typemix( hash, 0 ) & ( buckets - 1 )] ) & ( slots - 1 )];
+    if ( k < 0 || keys[k].size() != len ) return -1;
+    for ( std::size_t i {}; i < len; ++i ) {
+      if ( std::uint32_t( static_cast<unsigned char>( keys[k][i] ) ) != std::uint32_t( str[i] ) ) return -1;
+    }
+    return k;
+  }
+
+private:
+  std::array<std::string_view,N> keys {};
+  std::array<std::uint32_t,buckets> seeds {};
+  std::array<int,slots> index {};
+};
+
+#endif
@@ -40,39 +40,13 @@ void json2map( QByteArray& ba, QMap<QString, QVariant>& cutmap )
 
 
 //!
-//! Read JSON from 'filename' and add userdata.
+//! Add JSON from 'userdata', a file or JSON text, to 'cutmap'.
 //! Return two-column table
 //!
-QMap<QString, QVariant> readjson( const QString& filename, const QString& userdata )
+QMap<QString, QVariant> readjson( QMap<QString, QVariant> cutmap, const QString& userdata )
 {
-  QMap<QString, QVariant> cutmap;
   QByteArray ba;
 
-  // read default cutoffs
-  QString appdir = QStandardPaths::locate( QStandardPaths::AppDataLocation, filename );
-  if ( appdir.isEmpty() ) {
-    //std::cout << "Not in QStandardPaths::AppDataLocation\n";
-    QDir myloc( QCoreApplication::applicationDirPath() );
-    myloc.cdUp();
-    myloc.cd( "share" );
-    myloc.cd( QCoreApplication::organizationName() );
-    myloc.cd( QCoreApplication::applicationName() );
-    if ( myloc.exists() ) {
-      //std::cout << "DataLocation: " << qPrintable(myloc.path()) << '\n';
-      appdir = myloc.path() + "/" + filename;
-    }
-  }
-
-  if ( not appdir.isEmpty() )
-  {
-    QFile cfile(appdir);
-    if ( cfile.open(QIODevice::ReadOnly | QIODevice::Text) )
-    {
-      ba = cfile.readAll();
-      json2map( ba, cutmap );
-    }
-  }
-
   // add custom cutoffs from user
   if ( ! userdata.isEmpty() )
   {
@@ -91,3 +65,17 @@ QMap<QString, QVariant> readjson( const QString& filename, const QString& userda
 
   return cutmap;
 }
+
+
+//!
+//! Path of table 'filename' that the user has placed into the application
+//! data location of the user (e.g. ~/.local/share/SBL/o-lap/), or empty.
+//! Only that directory is checked, so runs without an override read no files.
+//!
+QString locatejson( const QString& filename )
+{
+  const QString dir = QStandardPaths::writableLocation( QStandardPaths::AppDataLocation );
+  if ( dir.isEmpty() ) return QString();
+  const QString path = dir + "/" + filename;
+  return QFileInfo( path ).isFile() ? path : QString();
+}
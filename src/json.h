@@ -21,6 +21,8 @@
 
 #include <QtCore>
 
-QMap<QString, QVariant> readjson( const QString& filename, const QString& userdata );
+QMap<QString, QVariant> readjson( QMap<QString, QVariant> cutmap, const QString& userdata );
+
+QString locatejson( const QString& filename );
 
 #endif
@@ -23,7 +23,18 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <numeric>
 #include <cmath>
+#include <memory>
+#include <deque>
+#include <atomic>
+#include <tuple>
+#include <random>
+#include <thread>
+#include <cstdint>
+#include <limits>
+#include <chrono>
+#include <csignal>
 
 #include <QtCore>
 
@@ -31,6 +42,18 @@
 #include "Point.h"
 #include "Atom.h"
 #include "json.h"
+#include "DefaultTables.h"
+#include "ModelCache.h"
+#include "ClusterState.h"
+#include "Parallel.h"
+#include "Intern.h"
+#include "Stats.h"
+#include "PairKernel.h"
+#include "Compression.h"
+#include "BoundedQueue.h"
+#include "FollowDevice.h"
+#include "Prefetch.h"
+#include "HotspotIndex.h"
 
 void header( std::ostream& out, const QString& name, size_t atoms )
 {
@@ -56,19 +79,33 @@ void merge( std::ostream& out, const std::vector<Molecule>& mols, const std::vec
     size_t num {0};
     for ( size_t i=0; i < mols.size(); ++i ) {
       if ( not skipped[i] ) {
-        for ( auto atom : mols[i].atoms ) {
-          atom.front() = QString::number( ++num );
-          out << qPrintable( atom.join(' ') ) << '\n';
+        for ( const auto& atom : mols[i].atoms ) {
+          write( out, atom, ++num ) << '\n';
         }
       }
     }
     out << '\n';
 }
 
+//!
+//! Comment lines about origin of output
+//!
+void banner( std::ostream& out, int argc, char *argv[] )
+{
+  out << "# Output from overlap " << qPrintable( QCoreApplication::applicationVersion() ) << '\n';
+  out << "# Created: " << qPrintable(QDateTime::currentDateTime().toString()) << '\n';
+  out << "# Command:";
+  for (int a{}; a < argc; ++a ) out << ' ' << argv[a];
+  out << '\n';
+}
+
 std::map<QString,int> atomtypes
 {
 };
 
+// atomtypes are the compiled-in defaults
+bool defaulttypes {true};
+
 
 //!
 //! Show atomtypes as categories and in JSON
@@ -103,20 +140,158 @@ void showsimilar()
 
 int atomtype( const QString & lhs )
 {
+  if ( defaulttypes ) return defaultatomtype( lhs );
   auto lp = atomtypes.find( lhs );
   if ( lp != atomtypes.end() ) return lp->second;
   return 0;
 }
 
-bool sametype( const Atom & lhs, const Atom & rhs, bool similar, double charge = 0.2 )
+bool sametype( const QString & ltype, double lcharge, const QString & rtype, double rcharge,
+               bool similar, double charge = 0.2 )
 {
-  if ( charge < std::abs(lhs.charge - rhs.charge) ) return false;
+  if ( charge < std::abs(lcharge - rcharge) ) return false;
   if ( similar ) {
-    auto lp = atomtypes.find( lhs.type );
-    auto rp = atomtypes.find( rhs.type );
+    auto lp = atomtypes.find( ltype );
+    auto rp = atomtypes.find( rtype );
     if ( lp != atomtypes.end() && rp != atomtypes.end() ) return lp->second == rp->second;
   }
-  return lhs.type == rhs.type;
+  return ltype == rtype;
+}
+
+bool sametype( const Atom & lhs, const Atom & rhs, bool similar, double charge = 0.2 )
+{
+  return sametype( lhs.type, lhs.charge, rhs.type, rhs.charge, similar, charge );
+}
+
+
+//!
+//! Key of type for PairData: atoms are of same type, if their keys are equal.
+//! With 'similar' types of a category share the category as key.
+//!
+int typekey( const QString& type, bool similar, std::map<QString,int>& others )
+{
+  if ( similar ) {
+    auto lp = atomtypes.find( type );
+    if ( lp != atomtypes.end() ) return lp->second;
+  }
+  // keys of types outside categories follow the category numbers
+  static constexpr int first = 1 << 20;
+  return others.emplace( type, first + int(others.size()) ).first->second;
+}
+
+
+//!
+//! Arrays of atoms for the pair kernels
+//!
+void loadpairs( PairData& d, const std::vector<Atom>& atoms, bool similar, double chargediff )
+{
+  d.clear();
+  std::map<QString,int> others;
+  double qmin {};
+  double qmax {};
+  for ( const auto& atom : atoms ) {
+    const auto pos = atom.pos();
+    d.x.push_back( pos.x );
+    d.y.push_back( pos.y );
+    d.z.push_back( pos.z );
+    d.charge.push_back( atom.charge );
+    d.key.push_back( typekey( atom.type, similar, others ) );
+    d.mono.push_back( atom.mono() );
+    d.allmono = d.allmono && atom.mono();
+    qmin = d.size() == 1 ? atom.charge : std::min( qmin, atom.charge );
+    qmax = d.size() == 1 ? atom.charge : std::max( qmax, atom.charge );
+  }
+  d.chargetest = chargediff < qmax - qmin;
+}
+
+
+//!
+//! Atoms of a bin in order of charge. Pairs whose charges differ more
+//! than 'chargediff' can never be of same type, so they are not generated.
+//!
+class ChargeIndex {
+public:
+  explicit ChargeIndex( const PairData& d ) : ChargeIndex( d, own ) {}
+
+  //! Index that keeps the order in 'storage', e.g. of a Workspace
+  ChargeIndex( const PairData& d, std::vector<size_t>& storage )
+    : charge{d.charge}, order{storage}, sorted{d.chargetest}
+  {
+    order.resize( d.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    if ( sorted ) {
+      std::stable_sort( order.begin(), order.end(),
+                        [this]( size_t l, size_t r ) { return charge[l] < charge[r]; } );
+    }
+  }
+
+  //! Atoms after 'row' with charge within 'chargediff' of 'row'.
+  //! Order of atoms is not specified.
+  void candidates( size_t row, double chargediff, std::vector<size_t>& cand ) const
+  {
+    cand.clear();
+    if ( ! sorted ) {
+      // all charges are within chargediff
+      cand.insert( cand.end(), order.begin() + row + 1, order.end() );
+      generated += cand.size();
+      return;
+    }
+
+    // slightly wider window, because the kernels make the exact test
+    const double slack = 1e-9 * (1.0 + std::abs( chargediff ));
+    const double lo = charge[row] - chargediff - slack;
+    const double hi = charge[row] + chargediff + slack;
+    auto first = std::lower_bound( order.begin(), order.end(), lo,
+                                   [this]( size_t i, double q ) { return charge[i] < q; } );
+    auto last = std::upper_bound( first, order.end(), hi,
+                                  [this]( double q, size_t i ) { return q < charge[i]; } );
+    for ( auto it = first; it != last; ++it ) {
+      if ( row < *it ) cand.push_back( *it );
+    }
+
+    skipped += (order.size() - row - 1) - cand.size();
+    generated += cand.size();
+  }
+
+  ~ChargeIndex()
+  {
+    stats().pairs += generated;
+    stats().pruned += skipped;
+  }
+
+private:
+  const std::vector<double>& charge;
+  std::vector<size_t> own;
+  std::vector<size_t>& order;
+  bool sorted;
+  // candidates() may be called from several threads
+  mutable std::atomic<unsigned long long> generated {0};
+  mutable std::atomic<unsigned long long> skipped {0};
+};
+
+
+//!
+//! Distance limit for merging atoms of 'type': its type specific cutoff,
+//! or 'cutoff', if it has none.
+//!
+double typelimit( const QString & type, double cutoff, const QMap<QString, QVariant>& cutmap )
+{
+  auto it = cutmap.find( type );
+  if ( it != cutmap.end() ) {
+    return it.value().toDouble();
+  }
+  return cutoff;
+}
+
+//!
+//! Distance limit for merging atoms of types 'ltype' and 'rtype': the
+//! smaller of their limits. Symmetric, so that the order of atoms does
+//! not matter.
+//!
+double pairlimit( const QString & ltype, const QString & rtype,
+                  double cutoff, const QMap<QString, QVariant>& cutmap )
+{
+  return std::min( typelimit( ltype, cutoff, cutmap ), typelimit( rtype, cutoff, cutmap ) );
 }
 
 double sqrdist( const Atom & lhs, const Atom & rhs )
@@ -145,304 +320,1839 @@ double sdist( const Atom & lhs, const Atom & rhs )
 
 
 //!
-//! Fuse atoms based on MCL-style cluster data
+//! Lines of MCL-style cluster data
+//!
+using MclLines = std::vector<QByteArray>;
+
+
+//!
+//! Molecule index of a label that has been tagged with "m<index>_".
+//! Returns -1 for untagged label.
+//!
+long label2molecule( const QByteArray& label )
+{
+  if ( label.startsWith( "m" ) ) {
+    return label.mid( 1, label.indexOf( '_' ) - 1 ).toLong();
+  }
+  return -1;
+}
+
+
+//!
+//! Category and index of atom from label "[m<index>_]<category>_<index>_<name>"
+//! that starts at 'label'. Returns pointer past the label.
+//!
+const char* label2atom( const char* label, const char* end, unsigned long& tnum, unsigned long& anum )
+{
+  auto number = [end]( const char*& p ) {
+    unsigned long value {};
+    for ( ; p < end && '0' <= *p && *p <= '9'; ++p ) value = value * 10 + (*p - '0');
+    if ( p < end && '_' == *p ) ++p;
+    return value;
+  };
+
+  const char* p = label;
+  if ( p < end && 'm' == *p ) {
+    ++p;
+    number( p );
+  }
+  tnum = number( p );
+  anum = number( p );
+  while ( p < end && '\t' != *p ) ++p;
+  return p;
+}
+
+
+void label2atom( const QByteArray& label, unsigned long& tnum, unsigned long& anum )
+{
+  label2atom( label.constData(), label.constData() + label.size(), tnum, anum );
+}
+
+
+//!
+//! Split MCL-style cluster data into blocks by molecule tag of the first
+//! label on each line. The file is read once. Untagged lines are in block -1.
+//!
+std::map<long,MclLines> readmcl( QIODevice& input )
+{
+  PhaseTimer timer( "mcl input" );
+  std::map<long,MclLines> blocks;
+  while ( !input.atEnd() ) {
+    const auto line = input.readLine().trimmed();
+    if ( line.isEmpty() ) continue;
+    blocks[ label2molecule( line ) ].push_back( line );
+  }
+  return blocks;
+}
+
+
+//!
+//! Lines of MCL-style cluster data that apply to molecule
+//!
+MclLines mcllines( const std::map<long,MclLines>& blocks, size_t molecule )
+{
+  MclLines lines;
+  auto it = blocks.find( -1 );
+  if ( it != blocks.end() ) lines = it->second;
+  it = blocks.find( molecule );
+  if ( it != blocks.end() ) lines.insert( lines.end(), it->second.begin(), it->second.end() );
+  return lines;
+}
+
+
+//!
+//! Fuse atoms based on MCL-style cluster data.
+//! Membership is tracked with a bitset per category. Cluster is accumulated
+//! as sum of coordinates over member indices; atoms are not modified.
+//!
+std::vector<Atom> mcl2atoms( const MclLines& lines, const std::map<int,std::vector<Atom>>& atomcats,
+                             unsigned long cmin, unsigned long cminchr, double nibthreshold )
+{
+  PhaseTimer timer( "mcl2atoms" );
+  std::vector<Atom> result;
+  std::map<int,std::vector<bool>> used;
+  for ( const auto& cat : atomcats ) {
+    used[cat.first].assign( cat.second.size(), false );
+  }
+
+  for ( const auto& line : lines ) {
+    const char* p = line.constData();
+    const char* end = p + line.size();
+    while ( p < end && '\t' == *p ) ++p;
+    if ( p == end ) continue;
+
+    unsigned long tnum {};
+    unsigned long anum {};
+    p = label2atom( p, end, tnum, anum );
+    const auto& rep = atomcats.at( tnum )[ anum ];
+    used.at( tnum )[ anum ] = true;
+
+    Point sum = rep.pos();
+    unsigned long count {1};
+    double toc = rep.charge;
+    while ( p < end ) {
+      while ( p < end && '\t' == *p ) ++p;
+      if ( p == end ) break;
+      unsigned long wtnum {};
+      unsigned long wanum {};
+      p = label2atom( p, end, wtnum, wanum );
+      const auto& member = atomcats.at( wtnum )[ wanum ];
+      used.at( wtnum )[ wanum ] = true;
+      sum += member.pos();
+      ++count;
+
+      const double frc = member.charge;
+      if ( std::abs(toc) < std::abs(frc) ) toc = frc;
+    }
+
+    // keep the weight of the cluster for --partial
+    Atom fused( rep.serial, rep.name, sum / count, rep.type, toc );
+    fused.sum = sum;
+    fused.count = count;
+    if ( std::abs(toc) <= nibthreshold ) {
+      if ( cmin <= count ) {
+        result.push_back( fused );
+      }
+    } else {
+      if ( cminchr <= count ) {
+        result.push_back( fused );
+      }
+    }
+  }
+
+  // if MCL output does not contain all single atom clusters
+  // then must print the rest separately
+  if ( cmin < 2 ) {
+    for ( const auto& cat : atomcats ) {
+      const auto& flags = used.at( cat.first );
+      for ( unsigned long anum {}; anum < cat.second.size(); ++anum ) {
+        if ( ! flags[ anum ] ) {
+          if ( std::abs(cat.second[ anum ].charge) <= nibthreshold ) {
+            if ( cmin < 2 ) {
+              result.push_back( cat.second[ anum ] );
+            }
+          } else {
+            if ( cminchr <= 2 ) {
+              result.push_back( cat.second[ anum ] );
+            }
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+
+//!
+//! Write atoms fused from MCL-style cluster data as model
+//!
+void mclmodel( std::ostream& out, const std::vector<Atom>& atoms,
+               size_t molecule, const QString& prefix, int argc, char *argv[] )
+{
+  PhaseTimer timer( "output" );
+  banner( out, argc, argv );
+  out << '\n';
+  header( out, QString("%1%2").arg(prefix).arg(molecule), atoms.size() );
+  unsigned long serial {0};
+  for ( const auto& atom : atoms ) {
+    ++serial;
+    print( out, atom, serial );
+    out << '\n';
+  }
+}
+
+
+//!
+//! Run 'mcl' on ABC-format 'graph' once for each inflation value and map
+//! each result to atoms. The graph is written once into a temporary file
+//! that all mcl processes read. The processes run concurrently.
+//! With more than one value the inflation is appended to the prefix.
+//!
+int mclsweep( const std::string& graph, QStringList inflations, const QString& threads,
+              const std::map<int,std::vector<Atom>>& atomcats,
+              size_t molecule, const QString& prefix, int argc, char *argv[],
+              unsigned long cmin, unsigned long cminchr, double nibthreshold )
+{
+  PhaseTimer timer( "mcl" );
+  QTemporaryFile input;
+  if ( !input.open() ) {
+    std::cerr << "Failed to write input for mcl\n";
+    return 1;
+  }
+  input.write( graph.c_str(), graph.size() );
+  input.flush();
+
+  const bool sweep = 1 < inflations.size();
+  if ( inflations.isEmpty() ) inflations << QString();
+
+  std::vector<std::unique_ptr<QTemporaryFile>> outputs;
+  std::vector<std::unique_ptr<QProcess>> runs;
+  for ( const auto& inflation : inflations ) {
+    outputs.emplace_back( new QTemporaryFile );
+    if ( !outputs.back()->open() ) {
+      std::cerr << "Failed to create output for mcl\n";
+      return 1;
+    }
+
+    QStringList mclopt { input.fileName(), "--abc", "-V", "all" };
+    if ( ! inflation.isEmpty() ) {
+      mclopt << "-I" << inflation;
+    }
+    if ( ! threads.isEmpty() ) {
+      mclopt << "--te" << threads;
+    }
+    mclopt << "-o" << outputs.back()->fileName();
+
+    runs.emplace_back( new QProcess );
+    runs.back()->start( "mcl", mclopt );
+    if ( !runs.back()->waitForStarted() ) {
+      std::cerr << "Failed to start mcl\n";
+      return 1;
+    }
+  }
+
+  for ( size_t r {}; r < runs.size(); ++r ) {
+    if ( !runs[r]->waitForFinished( -1 ) ) {
+      return 2;
+    }
+    // a failed run would look like a clustering without clusters
+    if ( QProcess::NormalExit != runs[r]->exitStatus() || 0 != runs[r]->exitCode() ) {
+      std::cerr << "mcl failed";
+      if ( sweep ) std::cerr << " with -I " << qPrintable( inflations[r] );
+      std::cerr << " (exit code " << runs[r]->exitCode() << ")\n";
+      return 2;
+    }
+    // without clusters every atom is a cluster of its own, as in --mapmcl
+    const auto lines = mcllines( readmcl( *outputs[r] ), molecule );
+    const QString name = sweep ? QString( "%1_I%2_" ).arg( prefix ).arg( inflations[r] ) : prefix;
+    mclmodel( std::cout, mcl2atoms( lines, atomcats, cmin, cminchr, nibthreshold ),
+              molecule, name, argc, argv );
+  }
+  return 0;
+}
+
+
+//!
+//! Show types of atoms in MCL-style cluster data
+//!
+void mcl2types( const MclLines& lines, const std::map<int,std::vector<Atom>>& atomcats, QTextStream& ostr )
+{
+  for ( const auto& line : lines ) {
+    bool empty = true;
+    for ( const auto& w : line.split( '\t' ) ) {
+      if ( w.isEmpty() ) continue;
+      unsigned long tnum {};
+      unsigned long anum {};
+      label2atom( w, tnum, anum );
+      ostr << QString("%1").arg( atomcats.at( tnum )[ anum ].type, -6 );
+      empty = false;
+    }
+    if ( ! empty ) ostr << '\n';
+  }
+}
+
+
+//!
+//! Remove clusters that are smaller than 'cmin', or 'cminchr' when charged
+//!
+void clusterfilter( std::vector<Atom>& atoms, unsigned long cmin, unsigned long cminchr,
+                    double nibthreshold )
+{
+  atoms.erase( std::remove_if( atoms.begin(), atoms.end(),
+                               [cmin,nibthreshold](const Atom& x)
+                               { return x.count < cmin &&
+                                   std::abs(x.charge) <= nibthreshold;
+                               }
+                 ),
+               atoms.end());
+  atoms.erase( std::remove_if( atoms.begin(), atoms.end(),
+                               [cminchr,nibthreshold](const Atom& x)
+                               { return x.count < cminchr &&
+                                   nibthreshold < std::abs(x.charge);
+                               }
+                 ),
+               atoms.end());
+}
+
+
+//!
+//! Order of pairs at equal distance: by the lower and then the higher
+//! serial of the pair, then by their indices in the model. Merges do not
+//! depend on the order of atoms in the bin.
+//!
+bool pairbefore( const Atom& l1, const Atom& l2, const Atom& r1, const Atom& r2 )
+{
+  return std::make_pair( std::minmax( l1.serial, l2.serial ), std::minmax( l1.index, l2.index ) )
+    < std::make_pair( std::minmax( r1.serial, r2.serial ), std::minmax( r1.index, r2.index ) );
+}
+
+
+//!
+//! Cluster of 'lhs' is kept, when 'rhs' merges into it
+//!
+bool keepsbefore( const Atom& lhs, const Atom& rhs )
+{
+  return std::tie( lhs.serial, lhs.index ) < std::tie( rhs.serial, rhs.index );
+}
+
+
+//!
+//! Limits of merging from --time-budget and --memory-budget. The merge
+//! engines check them as they go and end early, when they are exceeded.
+//!
+struct Budget {
+  std::chrono::steady_clock::time_point deadline {std::chrono::steady_clock::time_point::max()};
+  double memory {}; // bytes, 0 is no limit
+
+  //! True, if less than 'ahead' is left until the deadline
+  bool overtime( std::chrono::steady_clock::duration ahead = {} ) const
+  {
+    return deadline != std::chrono::steady_clock::time_point::max()
+      && deadline - std::chrono::steady_clock::now() < ahead;
+  }
+} budget;
+
+//! How a merge engine ended
+enum class MergeEnd { Done, Time, Memory };
+
+
+//!
+//! Pair of clusters in the heap of sparse_merge.
+//! 'keep' has the lower serial (or index, when serials are equal).
+//!
+struct MergeEdge {
+  double dist;
+  unsigned long keeps, drops;
+  unsigned long lowindex, highindex;
+  size_t keep, drop;
+  unsigned long keepv, dropv;
+};
+
+
+//!
+//! Scratch buffers of a worker thread. The same workspace is used for
+//! every merge and molecule of the worker, and the buffers keep their
+//! capacity, so clustering does not allocate after warm-up.
+//!
+struct Workspace {
+  std::vector<double> distmat;   // internal_merge
+  PairData data;
+  std::vector<size_t> order;     // ChargeIndex
+  std::vector<size_t> cand;
+  std::vector<MergeEdge> heap;   // sparse_merge
+  std::vector<unsigned long> version;
+  std::vector<char> alive;
+  std::vector<int> key;
+};
+
+
+//!
+//! Workspaces of 'count' workers, kept for later calls. Only one
+//! clustering (of any number of workers) may use them at a time.
+//!
+std::deque<Workspace>& workspaces( size_t count )
+{
+  static std::deque<Workspace> pool;
+  while ( pool.size() < count ) pool.emplace_back();
+  return pool;
+}
+
+
+//!
+//! Merge the nearest pair of atoms until no pair is within cutoff.
+//! Of a merged pair, the cluster with the lower serial is kept.
+//! Returns MergeEnd::Time without filtering the clusters, when the rest
+//! of the merges would not fit in the time budget; the merges done so
+//! far are the same as in sparse_merge, which can continue them.
+//!
+MergeEnd internal_merge( std::vector<Atom>& atoms, unsigned long cmin, unsigned long cminchr,
+                         double nibthreshold, double cutoff,
+                         bool similar, double chargediff, QMap<QString, QVariant> cutmap,
+                         Workspace& ws )
+{
+  PhaseTimer timer( "internal_merge" );
+  double best = 99999999.0;
+  auto& distmat = ws.distmat;
+  auto& data = ws.data;
+  auto& cand = ws.cand;
+  auto last = std::chrono::steady_clock::now();
+  while ( 1 < atoms.size() ) {
+    // a merge costs n*n, so the clock is cheap in comparison; the
+    // remaining n merges cost about n/3 times the last one
+    const auto now = std::chrono::steady_clock::now();
+    if ( budget.overtime( (now - last) * (atoms.size() / 3 + 1) ) ) return MergeEnd::Time;
+    last = now;
+    distmat.assign( atoms.size() * atoms.size(), 99999999.0 );
+    loadpairs( data, atoms, similar, chargediff );
+    const auto kernel = distancekernel( data );
+    const ChargeIndex index( data, ws.order );
+    for ( size_t row {}; row + 1 < atoms.size(); ++row ) {
+      index.candidates( row, chargediff, cand );
+      kernel( data, row, cand, chargediff, distmat.data() + row * atoms.size() );
+    }
+    // nearest pair; pairs at equal distance in order of serials
+    const size_t n = atoms.size();
+    size_t row {};
+    size_t col {};
+    best = 99999999.0;
+    for ( size_t r {}; r + 1 < n; ++r ) {
+      const double* dist = distmat.data() + r * n;
+      for ( size_t c = r + 1; c < n; ++c ) {
+        if ( dist[c] < best ||
+             (dist[c] == best && row != col && pairbefore( atoms[r], atoms[c], atoms[row], atoms[col] )) ) {
+          best = dist[c];
+          row = r;
+          col = c;
+        }
+      }
+    }
+    // only atoms within cutoff limit can be merged
+    if ( row == col || pairlimit( atoms[row].type, atoms[col].type, cutoff, cutmap ) < best ) break;
+
+    // keeps the most extreme charge in the cluster
+    if ( keepsbefore( atoms[col], atoms[row] ) ) std::swap( row, col );
+    atoms[row].add( atoms[col] );
+
+    atoms.erase( begin(atoms) + col );
+  }
+
+  clusterfilter( atoms, cmin, cminchr, nibthreshold );
+  return MergeEnd::Done;
+}
+
+
+//!
+//! Longest distance at which any two of 'atoms' could merge
+//!
+double mergereach( const std::vector<Atom>& atoms, double cutoff,
+                   const QMap<QString, QVariant>& cutmap )
+{
+  double reach {};
+  for ( const auto& atom : atoms ) {
+    reach = std::max( reach, typelimit( atom.type, cutoff, cutmap ) );
+  }
+  return reach;
+}
+
+
+//!
+//! Same merges as internal_merge, but only pairs within merge reach are
+//! kept, in a heap. Pairs of a changed cluster are recomputed and the
+//! stale ones skipped when they surface. Ties are broken by serials, then
+//! by index, as in internal_merge, so the result is identical.
+//! When the budget ends, merging stops and the clusters so far are kept.
+//! The heap grows only within the memory budget; when the pairs of the
+//! atoms do not fit, no atom is merged and the atoms are not filtered.
+//!
+MergeEnd sparse_merge( std::vector<Atom>& atoms, unsigned long cmin, unsigned long cminchr,
+                       double nibthreshold, double cutoff,
+                       bool similar, double chargediff, QMap<QString, QVariant> cutmap,
+                       Workspace& ws )
+{
+  PhaseTimer timer( "sparse_merge" );
+  const size_t n = atoms.size();
+  const double reach = mergereach( atoms, cutoff, cutmap );
+
+  std::map<QString,int> others;
+  auto& key = ws.key;
+  key.resize( n );
+  for ( size_t i {}; i < n; ++i ) key[i] = typekey( atoms[i].type, similar, others );
+
+  // binary heap in the workspace, nearest pair on top
+  auto later = []( const MergeEdge& l, const MergeEdge& r ) {
+    return std::tie( l.dist, l.keeps, l.drops, l.lowindex, l.highindex )
+      > std::tie( r.dist, r.keeps, r.drops, r.lowindex, r.highindex );
+  };
+  auto& heap = ws.heap;
+  heap.clear();
+  auto& version = ws.version;
+  version.assign( n, 0 );
+  auto& alive = ws.alive;
+  alive.assign( n, 1 );
+
+  // the heap may not grow beyond the memory budget
+  const size_t maxheap = 0 < budget.memory ? size_t( budget.memory / sizeof(MergeEdge) )
+                                           : std::numeric_limits<size_t>::max();
+  bool full = false;
+
+  unsigned long long generated {};
+  auto push = [&]( size_t a, size_t b ) {
+    if ( full ) return;
+    ++generated;
+    if ( key[a] != key[b] ) return;
+    if ( chargediff < std::abs( atoms[a].charge - atoms[b].charge ) ) return;
+    auto d = atoms[a].pos() - atoms[b].pos();
+    double dist = sqrt( dot( d, d ) );
+    if ( atoms[a].mono() && atoms[b].mono() ) dist *= 2;
+    if ( reach < dist ) return;
+    if ( keepsbefore( atoms[b], atoms[a] ) ) std::swap( a, b );
+    const auto indices = std::minmax( atoms[a].index, atoms[b].index );
+    if ( heap.size() == heap.capacity() ) {
+      const size_t grown = std::min( std::max( 2 * heap.capacity(), size_t(64) ), maxheap );
+      if ( grown <= heap.size() ) {
+        full = true;
+        return;
+      }
+      heap.reserve( grown );
+    }
+    heap.push_back( MergeEdge{ dist, atoms[a].serial, atoms[b].serial, indices.first, indices.second,
+                               a, b, version[a], version[b] } );
+    std::push_heap( heap.begin(), heap.end(), later );
+  };
+
+  ClusterGrid grid( 0 < reach ? reach : 1.0 );
+  for ( size_t i {}; i < n; ++i ) grid.insert( i, 0, atoms[i].pos() );
+  for ( size_t i {}; i < n; ++i ) {
+    grid.near( 0, atoms[i].pos(), [&]( size_t j ) { if ( i < j ) push( i, j ); } );
+  }
+  if ( full ) {
+    // without all pairs no merge would be right
+    stats().pairs += generated;
+    return MergeEnd::Memory;
+  }
+
+  MergeEnd end = MergeEnd::Done;
+  for ( unsigned long popped {}; ! heap.empty(); ++popped ) {
+    // time budget is checked once in a while
+    if ( 0 == popped % 1024 ) {
+      if ( budget.overtime() ) {
+        end = MergeEnd::Time;
+        break;
+      }
+    }
+    std::pop_heap( heap.begin(), heap.end(), later );
+    const MergeEdge e = heap.back();
+    heap.pop_back();
+    if ( ! alive[e.keep] || ! alive[e.drop] ) continue;
+    if ( version[e.keep] != e.keepv || version[e.drop] != e.dropv ) continue;
+    // only atoms within cutoff limit can be merged
+    if ( pairlimit( atoms[e.keep].type, atoms[e.drop].type, cutoff, cutmap ) < e.dist ) break;
+
+    const auto from = atoms[e.keep].pos();
+    atoms[e.keep].add( atoms[e.drop] );
+    grid.erase( e.drop, 0, atoms[e.drop].pos() );
+    grid.move( e.keep, 0, from, atoms[e.keep].pos() );
+    alive[e.drop] = 0;
+    ++version[e.keep];
+    grid.near( 0, atoms[e.keep].pos(), [&]( size_t j ) { if ( j != e.keep ) push( e.keep, j ); } );
+    if ( full ) {
+      // pairs of the last merge are missing, so merging ends here
+      end = MergeEnd::Memory;
+      break;
+    }
+  }
+  stats().pairs += generated;
+
+  size_t kept {};
+  for ( size_t i {}; i < n; ++i ) {
+    if ( alive[i] ) {
+      if ( kept != i ) atoms[kept] = std::move( atoms[i] );
+      ++kept;
+    }
+  }
+  atoms.erase( atoms.begin() + kept, atoms.end() );
+
+  clusterfilter( atoms, cmin, cminchr, nibthreshold );
+  return end;
+}
+
+
+//!
+//! Clustering engines of a bin. The dense and sparse engines give the same
+//! clusters; the planner picks one by estimated cost. None is chosen, when
+//! no engine fits in --memory-budget.
+//!
+enum class Engine { Auto, Dense, Sparse, None };
+
+
+//!
+//! Choose engine for 'atoms' of bin 'cat'. Forced 'engine' is kept.
+//! Dense needs a n*n matrix and about n*n*n/4 pair tests, sparse keeps
+//! the pairs of atoms in neighbouring grid cells. Dense is used, when it
+//! is cheaper and fits in 'maxmemory' bytes (0 is no limit).
+//! The estimates and choice are written to 'log'.
+//!
+Engine plan( const std::vector<Atom>& atoms, int cat, Engine engine, double maxmemory,
+             double cutoff, const QMap<QString, QVariant>& cutmap, std::ostream& log )
+{
+  PhaseTimer timer( "plan" );
+  const double n = atoms.size();
+  const double reach = mergereach( atoms, cutoff, cutmap );
+
+  // atoms in neighbouring cells; each pair is seen twice
+  ClusterGrid grid( 0 < reach ? reach : 1.0 );
+  for ( size_t i {}; i < atoms.size(); ++i ) grid.insert( i, 0, atoms[i].pos() );
+  double near {};
+  for ( const auto& atom : atoms ) grid.near( 0, atom.pos(), [&near]( size_t ) { ++near; } );
+  const double edges = std::max( 1.0, (near - n) / 2 );
+
+  const double densemem  = n * n * sizeof(double);
+  const double denseops  = n * n / 2 * (n / 2 + 1);
+  const double sparsemem = 2 * edges * sizeof(MergeEdge) + n * 48;
+  const double sparseops = edges * (1 + std::log2( edges )) + n * 27;
+
+  Engine chosen = engine;
+  if ( Engine::Auto == engine ) {
+    const bool fits = 0 == maxmemory || densemem <= maxmemory;
+    chosen = fits && denseops <= sparseops ? Engine::Dense : Engine::Sparse;
+  }
+  // the budget applies also to a forced engine
+  const bool overbudget = Engine::Dense == chosen && 0 < budget.memory && budget.memory < densemem;
+  if ( overbudget ) chosen = Engine::Sparse;
+  const bool unmerged = Engine::Sparse == chosen && 0 < budget.memory && budget.memory < sparsemem;
+  if ( unmerged ) chosen = Engine::None;
+
+  log << qPrintable( QString( "# Engine: bin %1, %2 atoms: dense %3 MB %4 ops, sparse %5 MB %6 ops -> %7%8\n" )
+                     .arg( cat ).arg( atoms.size() )
+                     .arg( densemem / 1048576, 0, 'g', 3 ).arg( denseops, 0, 'g', 3 )
+                     .arg( sparsemem / 1048576, 0, 'g', 3 ).arg( sparseops, 0, 'g', 3 )
+                     .arg( Engine::Dense == chosen ? "dense" : Engine::Sparse == chosen ? "sparse" : "none" )
+                     .arg( Engine::Auto == engine ? "" : " (forced)" ) );
+  const double mem = Engine::Dense == chosen ? densemem : sparsemem;
+  if ( ! unmerged && 0 < maxmemory && maxmemory < mem ) {
+    log << "# Note: estimate exceeds --max-memory\n";
+  }
+  if ( overbudget && ! unmerged ) {
+    log << "# Budget: dense exceeds --memory-budget, using sparse\n";
+  }
+  return chosen;
+}
+
+
+//!
+//! Merge atoms of bin 'cat' with the engine chosen by plan().
+//! Clusters are in order of their serials (and indices).
+//!
+void cluster( std::vector<Atom>& atoms, int cat, Engine engine, double maxmemory,
+              unsigned long cmin, unsigned long cminchr,
+              double nibthreshold, double cutoff,
+              bool similar, double chargediff, QMap<QString, QVariant> cutmap,
+              Workspace& ws, std::ostream& log )
+{
+  const Engine chosen = plan( atoms, cat, engine, maxmemory, cutoff, cutmap, log );
+  if ( Engine::None == chosen ) {
+    // atoms are written as they are
+    const QString note = QString( "# Budget: bin %1 exceeds --memory-budget, not merged, its clusters are partial\n" )
+      .arg( cat );
+    log << qPrintable( note );
+    std::cerr << qPrintable( note );
+    std::sort( atoms.begin(), atoms.end(),
+               []( const Atom& l, const Atom& r ) { return keepsbefore( l, r ); } );
+    return;
+  }
+  bool sparse = Engine::Sparse == chosen;
+  if ( ! sparse &&
+       MergeEnd::Time == internal_merge( atoms, cmin, cminchr, nibthreshold, cutoff,
+                                         similar, chargediff, cutmap, ws ) ) {
+    // continue the same merges with the cheaper engine
+    log << qPrintable( QString( "# Budget: bin %1 exceeded --time-budget in dense, continued with sparse\n" )
+                       .arg( cat ) );
+    sparse = true;
+  }
+  if ( sparse ) {
+    const auto end = sparse_merge( atoms, cmin, cminchr, nibthreshold, cutoff,
+                                   similar, chargediff, cutmap, ws );
+    if ( MergeEnd::Done != end ) {
+      const QString note = QString( "# Budget: bin %1 stopped at --%2-budget, its clusters are partial\n" )
+        .arg( cat ).arg( MergeEnd::Time == end ? "time" : "memory" );
+      log << qPrintable( note );
+      std::cerr << qPrintable( note );
+    }
+  }
+  std::sort( atoms.begin(), atoms.end(),
+             []( const Atom& l, const Atom& r ) { return keepsbefore( l, r ); } );
+}
+
+
+//!
+//! Merge atoms of each bin, bins in parallel. Clusters are returned in
+//! order of bins and plans written to 'log' in the same order, so the
+//! result does not depend on 'threads'. Each thread uses its own workspace.
+//!
+std::vector<Atom> internal_clusters( std::map<int,std::vector<Atom>>& atomcats, int threads,
+                                     Engine engine, double maxmemory,
+                                     unsigned long cmin, unsigned long cminchr,
+                                     double nibthreshold, double cutoff,
+                                     bool similar, double chargediff,
+                                     QMap<QString, QVariant> cutmap, std::ostream& log )
+{
+  std::vector<std::pair<const int,std::vector<Atom>>*> bins;
+  for ( auto& cat : atomcats ) bins.push_back( &cat );
+  std::vector<std::ostringstream> plans( bins.size() );
+  auto& spaces = workspaces( std::max( 1, threads ) );
+  parallel_for_worker( bins.size(), threads, [&]( size_t b, size_t worker ) {
+    cluster( bins[b]->second, bins[b]->first, engine, maxmemory, cmin, cminchr, nibthreshold,
+             cutoff, similar, chargediff, cutmap, spaces[worker], plans[b] );
+  } );
+
+  std::vector<Atom> atoms;
+  for ( size_t b {}; b < bins.size(); ++b ) {
+    log << plans[b].str();
+    atoms.insert( atoms.end(), bins[b]->second.begin(), bins[b]->second.end() );
+  }
+  return atoms;
+}
+
+
+//!
+//! Clusters of the output models, collected for --index
+//!
+struct IndexSpots {
+  std::vector<Hotspot> spots;
+  std::vector<std::string> types;
+  std::vector<int> cats;
+  std::map<QString,std::uint32_t> ids;
+
+  //! Clusters of 'molecule', numbered as in its model
+  void add( size_t molecule, const std::vector<Atom>& atoms )
+  {
+    std::uint32_t num {0};
+    for ( const auto& atom : atoms ) {
+      auto it = ids.find( atom.type );
+      if ( it == ids.end() ) {
+        it = ids.emplace( atom.type, types.size() ).first;
+        types.push_back( atom.type.toStdString() );
+        cats.push_back( atomtype( atom.type ) );
+      }
+      Hotspot spot;
+      spot.pos      = atom.pos();
+      spot.charge   = atom.charge;
+      spot.count    = atom.count;
+      spot.molecule = molecule;
+      spot.serial   = ++num;
+      spot.type     = it->second;
+      spots.push_back( spot );
+    }
+  }
+};
+
+
+void internal_method( std::ostream& out, std::map<int,std::vector<Atom>>& atomcats, size_t molecule,
+                      double cutoff, const QCommandLineParser& parser, bool similar,
+                      double chargediff, int argc, char *argv[],
+                      unsigned long cmin, unsigned long cminchr, double nibthreshold,
+                      QMap<QString, QVariant> cutmap, Engine engine, double maxmemory,
+                      int threads, IndexSpots* index = nullptr )
+{
+  size_t original_count {};
+  for ( const auto& cat : atomcats ) original_count += cat.second.size();
+  std::ostringstream plans;
+  const auto atoms = internal_clusters( atomcats, threads, engine, maxmemory, cmin, cminchr,
+                                        nibthreshold, cutoff, similar, chargediff, cutmap, plans );
+  if ( index ) index->add( molecule, atoms );
+
+  QString prefix = parser.value( "prefix" );
+  banner( out, argc, argv );
+  out << "#\n" << plans.str();
+  if ( atoms.size() == original_count ) {
+    std::cerr << "# Note: No atoms were merged due to overlap\n";
+    out << "#\n# Note: No atoms were merged due to overlap\n";
+  }
+  out << '\n';
+  PhaseTimer timer( "output" );
+  header( out, QString("%1%2").arg(prefix).arg(molecule), atoms.size() );
+  unsigned long num {0};
+  for ( auto atom : atoms ) {
+    ++num;
+    print( out, atom, num );
+    out << '\n';
+  }
+  out << '\n';
+}
+
+
+//!
+//! Merge atoms into clusters of an existing state. Atoms of the model are
+//! first merged with each other as in internal_method. Each resulting
+//! cluster then joins the nearest compatible cluster of the state whose
+//! centroid is within the cutoff, or becomes a new cluster.
+//! Clusters of the state are not merged with each other. Only the cells
+//! of the state near the atoms are read, and only the clusters that
+//! changed are written, with their numbers in the state as serials.
+//! Returns false, when the state can't be written.
+//!
+bool append_method( StateFile& state, std::map<int,std::vector<Atom>>& atomcats, size_t molecule,
+                    double cutoff, const QString& prefix, bool similar,
+                    double chargediff, int argc, char *argv[],
+                    unsigned long cmin, unsigned long cminchr, double nibthreshold,
+                    QMap<QString, QVariant> cutmap, Engine engine, double maxmemory )
+{
+  const auto original_count = state.count( molecule );
+
+  unsigned long added {};
+  std::vector<quint64> changed;
+  std::ostringstream plans;
+  for ( auto& cat : atomcats ) {
+    auto& acat = cat.second;
+    cluster( acat, cat.first, engine, maxmemory, 1, 1, nibthreshold,
+             cutoff, similar, chargediff, cutmap, workspaces( 1 )[0], plans );
+    for ( const auto& atom : acat ) {
+      ++added;
+      const auto apos = atom.pos();
+      bool found = false;
+      quint64 nearest {};
+      Cluster best;
+      double bestdist {};
+      state.near( molecule, cat.first, apos, typelimit( atom.type, cutoff, cutmap ), [&]( quint64 id ) {
+        const auto c = state.cluster( id );
+        if ( ! sametype( c.type, c.charge, atom.type, atom.charge, similar, chargediff ) ) return;
+        auto d = c.pos() - apos;
+        double dist = sqrt( dot( d, d ) );
+        if ( c.mono() && atom.mono() ) dist *= 2;
+        if ( pairlimit( c.type, atom.type, cutoff, cutmap ) < dist ) return;
+        if ( ! found || dist < bestdist
+             || (dist == bestdist && state.serial( id ) < state.serial( nearest )) ) {
+          found = true;
+          nearest = id;
+          best = c;
+          bestdist = dist;
+        }
+      } );
+
+      Cluster c;
+      if ( found ) {
+        c = best;
+        c.sum += atom.sum;
+        c.count += atom.count;
+        if ( std::abs(c.charge) < std::abs(atom.charge) ) c.charge = atom.charge;
+        if ( ! state.update( nearest, c ) ) return false;
+      }
+      else {
+        c.type = atom.type;
+        c.sum = atom.sum;
+        c.count = atom.count;
+        c.charge = atom.charge;
+        if ( ! state.add( molecule, cat.first, c, nearest ) ) return false;
+      }
+      changed.push_back( nearest );
+    }
+  }
+
+  std::sort( changed.begin(), changed.end(),
+             [&state]( quint64 l, quint64 r ) { return state.serial( l ) < state.serial( r ); } );
+  changed.erase( std::unique( changed.begin(), changed.end() ), changed.end() );
+
+  std::ostringstream ostr;
+  unsigned long num {0};
+  for ( auto id : changed ) {
+    const auto c = state.cluster( id );
+    const bool charged = nibthreshold < std::abs(c.charge);
+    if ( c.count < (charged ? cminchr : cmin) ) continue;
+    ++num;
+    const unsigned long serial = state.serial( id );
+    print( ostr, Atom( serial, QString(), c.pos(), c.type, c.charge ), serial );
+    ostr << '\n';
+  }
+
+  banner( std::cout, argc, argv );
+  std::cout << "#\n" << plans.str();
+  std::cout << qPrintable( QString( "# Appended %1 clusters to %2 clusters of state, %3 clusters changed\n" )
+                           .arg( added ).arg( original_count ).arg( changed.size() ) );
+  std::cout << '\n';
+  header( std::cout, QString("%1%2").arg(prefix).arg(molecule), num );
+  std::cout << ostr.str() << '\n';
+  return true;
+}
+
+
+//!
+//! Write all clusters of 'state' as models, with their numbers in the
+//! state as serials
+//!
+void showstate_method( const StateFile& state, const QString& prefix, int argc, char *argv[],
+                       unsigned long cmin, unsigned long cminchr, double nibthreshold )
+{
+  std::map<size_t,std::vector<std::pair<quint64,Cluster>>> mols;
+  state.all( [&]( size_t molecule, quint64 serial, const Cluster& c ) {
+    const bool charged = nibthreshold < std::abs(c.charge);
+    if ( c.count < (charged ? cminchr : cmin) ) return;
+    mols[molecule].emplace_back( serial, c );
+  } );
+
+  for ( const auto& mol : mols ) {
+    banner( std::cout, argc, argv );
+    std::cout << '\n';
+    header( std::cout, QString("%1%2").arg(prefix).arg(mol.first), mol.second.size() );
+    for ( const auto& c : mol.second ) {
+      print( std::cout, Atom( c.first, QString(), c.second.pos(), c.second.type, c.second.charge ), c.first );
+      std::cout << '\n';
+    }
+    std::cout << '\n';
+  }
+}
+
+
+//!
+//! Open state 'filename' of --state. A text state of an earlier version
+//! is converted once. New states use 'cutoff' as grid cell.
+//!
+bool openstate( StateFile& state, const QString& filename, double cutoff )
+{
+  const double cell = 0 < cutoff ? cutoff : 1.0;
+  if ( ! StateFile::istext( filename ) ) return state.open( filename, cell );
+
+  ClusterState text;
+  if ( ! text.read( filename ) ) return false;
+  const QString converted = filename + ".new";
+  QFile::remove( converted );
+  StateFile binary;
+  if ( ! binary.open( converted, cell ) ) return false;
+  for ( const auto& mol : text.molecules() ) {
+    for ( const auto& c : mol.second ) {
+      quint64 id;
+      if ( ! binary.add( mol.first, atomtype( c.type ), c, id ) ) return false;
+    }
+  }
+  binary.close();
+  QFile::remove( filename );
+  return QFile::rename( converted, filename ) && state.open( filename, cell );
+}
+
+
+//!
+//! Clusters as weighted atoms, binned as in atoms2bins.
+//! Serials follow the order of 'clusters'.
+//!
+std::map<int,std::vector<Atom>> clusters2bins( const std::vector<Cluster>& clusters )
+{
+  std::map<int,std::vector<Atom>> atomcats;
+  unsigned long serial {};
+  for ( const auto& c : clusters ) {
+    Atom atom( ++serial, QString(), c.pos(), c.type, c.charge );
+    atom.sum = c.sum;
+    atom.count = c.count;
+    auto& acat = atomcats[atomtype( c.type )];
+    atom.index = acat.size();
+    acat.push_back( atom );
+  }
+  return atomcats;
+}
+
+
+//!
+//! Weighted clusters of 'atoms' in state format
+//!
+std::vector<Cluster> atoms2clusters( const std::vector<Atom>& atoms )
+{
+  std::vector<Cluster> clusters;
+  clusters.reserve( atoms.size() );
+  for ( const auto& atom : atoms ) {
+    Cluster c;
+    c.type = atom.type;
+    c.sum = atom.sum;
+    c.count = atom.count;
+    c.charge = atom.charge;
+    clusters.push_back( c );
+  }
+  return clusters;
+}
+
+
+//!
+//! Merge partial results (from --partial) of pose shards. Clusters of the
+//! same molecule in all 'partials' are merged as weighted atoms with the
+//! cutoff and type rules of a normal run. The result is written into
+//! 'partialfile', when given, for further reduction, or as model.
+//!
+int reduce_method( const QStringList& partials, const QString& partialfile,
+                   const QString& prefix, double cutoff, bool similar,
+                   double chargediff, int argc, char *argv[],
+                   unsigned long cmin, unsigned long cminchr, double nibthreshold,
+                   QMap<QString, QVariant> cutmap, Engine engine, double maxmemory,
+                   int threads )
+{
+  if ( partials.isEmpty() ) {
+    std::cerr << "Option --reduce requires partial results as arguments.\n";
+    return 1;
+  }
+
+  // clusters of each molecule from all partial results, in order of arguments
+  std::map<size_t,std::vector<Cluster>> mols;
+  for ( const auto& name : partials ) {
+    ClusterState part;
+    if ( ! part.read( name ) ) {
+      std::cerr << "Can't read partial result " << qPrintable(name) << "\n";
+      return 5;
+    }
+    for ( const auto& mol : part.molecules() ) {
+      auto& clusters = mols[mol.first];
+      clusters.insert( clusters.end(), mol.second.begin(), mol.second.end() );
+    }
+  }
+
+  ClusterState reduced;
+  for ( const auto& mol : mols ) {
+    auto bins = clusters2bins( mol.second );
+    std::ostringstream plans;
+    if ( ! partialfile.isEmpty() ) {
+      // clustermin applies only to the final model
+      reduced.clusters( mol.first ) =
+        atoms2clusters( internal_clusters( bins, threads, engine, maxmemory, 1, 1, nibthreshold,
+                                           cutoff, similar, chargediff, cutmap, plans ) );
+      continue;
+    }
+
+    const auto atoms = internal_clusters( bins, threads, engine, maxmemory, cmin, cminchr,
+                                          nibthreshold, cutoff, similar, chargediff, cutmap, plans );
+    banner( std::cout, argc, argv );
+    std::cout << "#\n" << plans.str();
+    std::cout << qPrintable( QString( "# Reduced %1 clusters of %2 partial results\n" )
+                             .arg( mol.second.size() ).arg( partials.size() ) );
+    std::cout << '\n';
+    PhaseTimer timer( "output" );
+    header( std::cout, QString("%1%2").arg(prefix).arg(mol.first), atoms.size() );
+    unsigned long num {0};
+    for ( const auto& atom : atoms ) {
+      ++num;
+      print( std::cout, atom, num );
+      std::cout << '\n';
+    }
+    std::cout << '\n';
+  }
+
+  if ( ! partialfile.isEmpty() && ! reduced.write( partialfile ) ) {
+    std::cerr << "Can't write partial result " << qPrintable(partialfile) << "\n";
+    return 5;
+  }
+  return 0;
+}
+
+
+//!
+//! Interleave the low 21 bits of 'v' with zero bits, two after each
+//!
+std::uint64_t spread3( std::uint64_t v )
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2)  & 0x1249249249249249ULL;
+  return v;
+}
+
+
+//!
+//! Order atoms along a Morton (Z-order) curve over their bounding box, so
+//! that atoms near in space are near in memory for the pair scans.
+//! Clusters do not depend on the order (see pairbefore) and labels use
+//! Atom::index, so the original order is not needed afterwards.
+//!
+void spatialsort( std::vector<Atom>& atoms )
+{
+  if ( atoms.size() < 3 ) return;
+  Point lo = atoms.front().pos();
+  Point hi = lo;
+  for ( const auto& atom : atoms ) {
+    const auto p = atom.pos();
+    lo = Point{ std::min( lo.x, p.x ), std::min( lo.y, p.y ), std::min( lo.z, p.z ) };
+    hi = Point{ std::max( hi.x, p.x ), std::max( hi.y, p.y ), std::max( hi.z, p.z ) };
+  }
+  const double extent = std::max( { hi.x - lo.x, hi.y - lo.y, hi.z - lo.z } );
+  const double scale = 0 < extent ? 2097151 / extent : 0;
+
+  std::vector<std::pair<std::uint64_t,size_t>> order( atoms.size() );
+  for ( size_t i {}; i < atoms.size(); ++i ) {
+    const auto p = atoms[i].pos();
+    order[i].first = spread3( std::uint64_t( (p.x - lo.x) * scale ) )
+      | spread3( std::uint64_t( (p.y - lo.y) * scale ) ) << 1
+      | spread3( std::uint64_t( (p.z - lo.z) * scale ) ) << 2;
+    order[i].second = i;
+  }
+  std::sort( order.begin(), order.end() );
+
+  std::vector<Atom> sorted;
+  sorted.reserve( atoms.size() );
+  for ( const auto& o : order ) sorted.push_back( std::move( atoms[o.second] ) );
+  atoms.swap( sorted );
+}
+
+
+//!
+//! Bin atoms according to type. Atoms of a bin are in model order,
+//! or with 'spatial' in order of spatialsort.
+//!
+std::map<int,std::vector<Atom>> atoms2bins( const std::vector<Mol2Atom>& atoms,
+                                            bool usenib, bool nibneutral, double nibthreshold,
+                                            const QStringList& deletelist, bool spatial = false )
+{
+  PhaseTimer timer( "atoms2bins" );
+  // interned, so that atoms share the text
+  static const QString O3 = intern( "O.3" );
+  static const QString N3 = intern( "N.3" );
+  static const QString C3 = intern( "C.3" );
+  static const QString Car = intern( "C.ar" );
+
+  std::map<int,std::vector<Atom>> atomcats;
+  for ( const auto& atom : atoms ) {
+    if ( atom.fields == 9 ) {
+      QString type = atom.type;
+      double charge = atom.charge;
+      if ( usenib ) {
+        if ( charge < -nibthreshold ) {
+          type = O3;
+        }
+        else if  ( charge > nibthreshold ) {
+          type = N3;
+        }
+        else {
+          if ( nibneutral ) charge = 0.0;
+          if ( type != Car ){
+            type = C3;
+          }
+        }
+      }
+
+      if ( ! deletelist.contains( type ) ) {
+        auto& acat = atomcats[atomtype(type)];
+        acat.emplace_back( atom.serial, atom.name, atom.pos, type, charge );
+        acat.back().index = acat.size() - 1;
+      }
+    }
+  }
+  if ( spatial ) {
+    PhaseTimer sorttimer( "spatialsort" );
+    for ( auto& cat : atomcats ) spatialsort( cat.second );
+  }
+  return atomcats;
+}
+
+
+//!
+//! Clusters as exact text, for comparing runs
+//!
+std::string fingerprint( const std::vector<Atom>& atoms )
+{
+  std::ostringstream out;
+  out << std::setprecision( 17 );
+  for ( const auto& atom : atoms ) {
+    out << atom.serial << ' ' << qPrintable( atom.type ) << ' ' << atom.count << ' '
+        << atom.sum.x << ' ' << atom.sum.y << ' ' << atom.sum.z << ' ' << atom.charge << '\n';
+  }
+  return out.str();
+}
+
+
+//!
+//! Cutoffs that differ between the types of 'bins': every other type,
+//! in order of name, gets half and the rest one and a half times its limit.
+//!
+QMap<QString, QVariant> mixedcutoffs( const std::map<int,std::vector<Atom>>& bins,
+                                      double cutoff, const QMap<QString, QVariant>& cutmap )
+{
+  std::set<QString> types;
+  for ( const auto& cat : bins ) {
+    for ( const auto& atom : cat.second ) types.insert( atom.type );
+  }
+  QMap<QString, QVariant> mixed;
+  bool shorter = true;
+  for ( const auto& type : types ) {
+    mixed[type] = typelimit( type, cutoff, cutmap ) * (shorter ? 0.5 : 1.5);
+    shorter = ! shorter;
+  }
+  return mixed;
+}
+
+
+//!
+//! Cluster each molecule 'runs' times more with atoms in shuffled order
+//! and 1..'threads' threads, and compare with a sequential run in original
+//! order. The auto engine alternates between sparse and dense, and with
+//! 'spatial' every other run orders bins with spatialsort. One more run
+//! uses --similar with cutoffs that differ between the types of a bin.
+//! Returns the number of runs that differ.
+//!
+unsigned long selfcheck( const std::vector<Molecule>& mols, unsigned long runs, int threads,
+                         Engine engine, double maxmemory, bool spatial,
+                         bool usenib, bool nibneutral, const QStringList& deletelist,
+                         unsigned long cmin, unsigned long cminchr, double nibthreshold,
+                         double cutoff, bool similar, double chargediff,
+                         QMap<QString, QVariant> cutmap )
+{
+  unsigned long failed {};
+  std::ostringstream plans;
+  for ( size_t i {}; i < mols.size(); ++i ) {
+    auto bins = atoms2bins( mols[i].atoms, usenib, nibneutral, nibthreshold, deletelist );
+    const auto expected = fingerprint( internal_clusters( bins, 1, engine, maxmemory, cmin, cminchr,
+                                                          nibthreshold, cutoff, similar,
+                                                          chargediff, cutmap, plans ) );
+    for ( unsigned long r = 1; r <= runs; ++r ) {
+      auto atoms = mols[i].atoms;
+      std::mt19937 gen( r );
+      std::shuffle( atoms.begin(), atoms.end(), gen );
+      const int t = 1 + (r - 1) % threads;
+      Engine e = engine;
+      if ( Engine::Auto == engine ) e = r % 2 ? Engine::Sparse : Engine::Dense;
+
+      auto shuffled = atoms2bins( atoms, usenib, nibneutral, nibthreshold, deletelist,
+                                  spatial && 0 == r % 2 );
+      const bool same = expected == fingerprint( internal_clusters( shuffled, t, e, maxmemory, cmin, cminchr,
+                                                                    nibthreshold, cutoff, similar,
+                                                                    chargediff, cutmap, plans ) );
+      std::cout << "# Self-check: molecule " << i << " run " << r << " threads " << t
+                << " engine " << (Engine::Dense == e ? "dense" : Engine::Sparse == e ? "sparse" : "auto")
+                << (spatial && 0 == r % 2 ? " spatialsort" : "")
+                << (same ? ": same\n" : ": DIFFERENT\n");
+      if ( ! same ) ++failed;
+    }
+    if ( 0 < runs ) {
+      // merge limits of mixed types, in reverse order of atoms
+      auto original = atoms2bins( mols[i].atoms, usenib, nibneutral, nibthreshold, deletelist );
+      const auto mixed = mixedcutoffs( original, cutoff, cutmap );
+      const auto reference = fingerprint( internal_clusters( original, 1, Engine::Dense, maxmemory, cmin, cminchr,
+                                                            nibthreshold, cutoff, true,
+                                                            chargediff, mixed, plans ) );
+      auto atoms = mols[i].atoms;
+      std::reverse( atoms.begin(), atoms.end() );
+      auto reversed = atoms2bins( atoms, usenib, nibneutral, nibthreshold, deletelist );
+      const Engine e = Engine::Auto == engine ? Engine::Sparse : engine;
+      const bool same = reference == fingerprint( internal_clusters( reversed, threads, e, maxmemory, cmin, cminchr,
+                                                                     nibthreshold, cutoff, true,
+                                                                     chargediff, mixed, plans ) );
+      std::cout << "# Self-check: molecule " << i << " mixed cutoffs threads " << threads
+                << " engine " << (Engine::Dense == e ? "dense" : Engine::Sparse == e ? "sparse" : "auto")
+                << (same ? ": same\n" : ": DIFFERENT\n");
+      if ( ! same ) ++failed;
+    }
+  }
+  return failed;
+}
+
+
+//!
+//! Label of atom in MCL data: "<category>_<index>_<name>"
 //!
-void mcl2atoms( QTextStream& istr, std::map<int,std::vector<Atom>>& atomcats,
-                size_t molecule, QString prefix, int argc, char *argv[],
-                unsigned long cmin, unsigned long cminchr, double nibthreshold )
+QString label( int cat, size_t index, const Atom& atom )
 {
-//  const auto original_count = atoms.size();
-  unsigned long count {0};
-  QString line;
-  while ( istr.readLineInto(&line) ) {
-    ++count;
-  }
+  return QString( "%1_%2_%3" ).arg(cat).arg(index).arg(atom.name);
+}
 
-  std::set<std::pair<unsigned long,unsigned long>> used;
-  if ( 0 < count && istr.seek( 0 ) ) {
-    unsigned long serial {0};
-    std::ostringstream ostr;
-    while ( istr.readLineInto(&line) ) {
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-      auto words = line.split('\t', QString::SkipEmptyParts);
-#else
-      auto words = line.split("\t", Qt::SkipEmptyParts);
-#endif
-      if ( 0 < words.size() ) {
-        auto id = words[0].split( "_" );
-        unsigned long tnum = id[0].toULong();
-        unsigned long anum = id[1].toULong();
-        used.insert( std::make_pair( tnum, anum ) );
-        auto& to = atomcats.at( tnum )[ anum ].posit;
-        double& toc = atomcats.at( tnum )[ anum ].charge;
-        for ( int w = 1; w < words.size(); ++w ) {
-          id = words[w].split( "_" );
-          unsigned long wtnum = id[0].toULong();
-          unsigned long wanum = id[1].toULong();
-          used.insert( std::make_pair( wtnum, wanum ) );
-          const auto& from = atomcats.at( wtnum )[ wanum ].posit;
-          to.insert( to.end(), from.begin(), from.end() );
-
-          const double frc = atomcats.at( wtnum )[ wanum ].charge;
-          if ( std::abs(toc) < std::abs(frc) ) toc = frc;
-        }
-        if ( std::abs(toc) <= nibthreshold ) {
-          if ( cmin <= to.size() ) {
-            ++serial;
-            print( ostr, atomcats.at( tnum )[ anum ], serial );
-            ostr << '\n';
-          }
-        } else {
-          if ( cminchr <= to.size() ) {
-            ++serial;
-            print( ostr, atomcats.at( tnum )[ anum ], serial );
-            ostr << '\n';
-          }
-        }
+
+//!
+//! Overlap graph of bins. Nodes are the atoms of added bins, numbered in
+//! order. Rows of bins are split into shards that can be processed in
+//! parallel; edges of a shard are in order of rows and columns.
+//!
+class BinGraph {
+public:
+  BinGraph( double cutoff, bool similar, double chargediff, const QMap<QString, QVariant>& cutmap )
+    : cutoff{cutoff}, similar{similar}, chargediff{chargediff}, cutmap{cutmap}
+  {}
+
+  //! Add atoms of bins as nodes. Labels of atoms are prefixed with 'tag'.
+  void add( const std::map<int,std::vector<Atom>>& atomcats, const QString& tag = QString() )
+  {
+    for ( const auto& cat : atomcats ) {
+      const auto& acat = cat.second;
+      bins.emplace_back( new Bin );
+      auto& bin = *bins.back();
+      bin.first = names.size();
+      bin.maxdist.reserve( acat.size() );
+      for ( size_t idx {}; idx < acat.size(); ++idx ) {
+        // labels refer to the model order of the bin, as in mapmcl
+        names.push_back( tag + label( cat.first, acat[idx].index, acat[idx] ) );
+        const double limit = typelimit( acat[idx].type, cutoff, cutmap );
+        bin.maxdist.push_back( limit * limit );
+      }
+      loadpairs( bin.data, acat, similar, chargediff );
+      bin.kernel = edgekernel( bin.data );
+      bin.index.reset( new ChargeIndex( bin.data ) );
+      for ( size_t row {}; row + 1 < acat.size(); row += shardrows ) {
+        shardlist.push_back( Shard{ &bin, row, std::min( row + shardrows, acat.size() - 1 ) } );
       }
     }
+  }
 
-    // if MCL output does not contain all single atom clusters
-    // then must print the rest separately
-    if ( cmin < 2 ) {
-      for ( const auto& cat : atomcats ) {
-        unsigned long tnum = cat.first;
-        for ( unsigned long anum {}; anum < cat.second.size(); ++anum ) {
-          if ( used.find( std::make_pair( tnum, anum )  ) == used.end() ) {
-            if ( std::abs(cat.second[ anum ].charge) <= nibthreshold ) {
-              if ( cmin < 2 ) {
-                ++serial;
-                print( ostr, cat.second[ anum ], serial );
-                ostr << '\n';
-              }
-            } else {
-              if ( cminchr <= 2 ) {
-                ++serial;
-                print( ostr, cat.second[ anum ], serial );
-                ostr << '\n';
-              }
-            }
-          }
-        }
-      }
+  size_t nodes() const { return names.size(); }
+  size_t shards() const { return shardlist.size(); }
+  const QString& name( size_t node ) const { return names[node]; }
+
+  //! Call f(row, col, weight) for edges of 'shard'; row < col are nodes.
+  //! Weight is the squared cutoff of row minus the squared distance.
+  template<class F>
+  void edges( size_t shard, F f ) const
+  {
+    const auto& sh = shardlist[shard];
+    const auto& bin = *sh.bin;
+    std::vector<size_t> cand;
+    std::vector<std::pair<size_t,double>> found;
+    for ( size_t row = sh.first; row < sh.last; ++row ) {
+      bin.index->candidates( row, chargediff, cand );
+      found.clear();
+      bin.kernel( bin.data, row, cand, chargediff, bin.maxdist[row], found );
+      std::sort( found.begin(), found.end() );
+      for ( const auto& e : found ) f( bin.first + row, bin.first + e.first, e.second );
     }
+  }
 
-    std::cout << "# Output from overlap " << qPrintable( QCoreApplication::applicationVersion() ) << '\n';
-    std::cout << "# Created: " << qPrintable(QDateTime::currentDateTime().toString()) << '\n';
-    std::cout << "# Command:";
-    for (int a{}; a < argc; ++a ) std::cout << ' ' << argv[a];
-    std::cout << "\n\n";
-    header( std::cout, QString("%1%2").arg(prefix).arg(molecule), serial );
-    std::cout << ostr.str();
+private:
+  struct Bin {
+    size_t first {};
+    std::vector<double> maxdist;
+    PairData data;
+    EdgeKernel kernel {};
+    std::unique_ptr<ChargeIndex> index;
+  };
+  struct Shard {
+    const Bin* bin;
+    size_t first, last;
+  };
+  static constexpr size_t shardrows = 256;
+
+  double cutoff;
+  bool similar;
+  double chargediff;
+  QMap<QString, QVariant> cutmap;
+  std::vector<std::unique_ptr<Bin>> bins;
+  std::vector<Shard> shardlist;
+  std::vector<QString> names;
+};
+
+
+//!
+//! Output pairs of atoms with similarity (computed from distance with cutoffs)
+//! Labels of atoms are prefixed with 'tag'.
+//! Shards of the graph are formatted in parallel into own buffers and
+//! written in order, so output does not depend on 'threads'.
+//!
+void bins2abc( std::ostream& ostr, const std::map<int,std::vector<Atom>>& atomcats,
+               double cutoff, bool similar,
+               double chargediff, const QMap<QString, QVariant>& cutmap,
+               const QString& tag = QString(), int threads = 1 )
+{
+  PhaseTimer timer( "bins2abc" );
+  BinGraph graph( cutoff, similar, chargediff, cutmap );
+  graph.add( atomcats, tag );
+
+  // a window of shards at a time bounds the buffered output
+  const size_t window = 4 * size_t( std::max( 1, threads ) );
+  std::vector<QByteArray> buffers( window );
+  for ( size_t w {}; w < graph.shards(); w += window ) {
+    const size_t count = std::min( window, graph.shards() - w );
+    parallel_for( count, threads, [&]( size_t s ) {
+      QString text;
+      graph.edges( w + s, [&]( size_t row, size_t col, double weight ) {
+        text += QString( "%1 %2 %3\n" ).arg( graph.name( row ) ).arg( graph.name( col ) ).arg( weight );
+      } );
+      buffers[s] = text.toLocal8Bit();
+    } );
+    for ( size_t s {}; s < count; ++s ) ostr.write( buffers[s].constData(), buffers[s].size() );
   }
 }
 
 
 //!
-//! Show types of atoms in MCL-style cluster data
+//! Write 'graph' as mcl native matrix into 'base'.mci and labels of its
+//! nodes into 'base'.tab (for mcl -use-tab). Like mcl --abc, only atoms
+//! with edges are nodes, and the matrix is symmetric.
+//! Returns false, if files can't be written.
 //!
-void mcl2types( QTextStream& istr, std::map<int,std::vector<Atom>>& atomcats, QTextStream& ostr )
+bool graph2mcx( const BinGraph& graph, const QString& base, int threads )
 {
-  QString line;
-  while ( istr.readLineInto(&line) ) {
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-    auto words = line.split('\t', QString::SkipEmptyParts);
-#else
-    auto words = line.split("\t", Qt::SkipEmptyParts);
-#endif
-    if ( 0 < words.size() ) {
-      for ( auto w : words ) {
-        const auto id = w.split( "_" );
-        unsigned long tnum = id[0].toULong();
-        unsigned long anum = id[1].toULong();
-        ostr << QString("%1").arg( atomcats.at( tnum )[ anum ].type, -6 );
-      }
-      ostr << '\n';
+  PhaseTimer timer( "graph2mcx" );
+  using Edge = std::tuple<size_t,size_t,double>;
+  std::vector<std::vector<Edge>> shards( graph.shards() );
+  parallel_for( shards.size(), threads, [&]( size_t s ) {
+    graph.edges( s, [&]( size_t row, size_t col, double weight ) {
+      shards[s].emplace_back( row, col, weight );
+    } );
+  } );
+
+  // both directions of edges by row, rows of connected atoms only
+  std::vector<std::vector<std::pair<size_t,double>>> rows( graph.nodes() );
+  for ( const auto& shard : shards ) {
+    for ( const auto& e : shard ) {
+      rows[ std::get<0>(e) ].emplace_back( std::get<1>(e), std::get<2>(e) );
+      rows[ std::get<1>(e) ].emplace_back( std::get<0>(e), std::get<2>(e) );
     }
   }
+  shards.clear();
+  std::vector<size_t> id( graph.nodes() );
+  size_t count {};
+  for ( size_t node {}; node < rows.size(); ++node ) {
+    if ( ! rows[node].empty() ) id[node] = count++;
+  }
+
+  QSaveFile mci( base + ".mci" );
+  QSaveFile tab( base + ".tab" );
+  if ( !mci.open( QIODevice::WriteOnly | QIODevice::Text ) ||
+       !tab.open( QIODevice::WriteOnly | QIODevice::Text ) ) return false;
+
+  QTextStream mout( &mci );
+  QTextStream tout( &tab );
+  mout << "(mclheader\nmcltype matrix\n"
+       << QString( "dimensions %1x%1\n" ).arg( count ) << ")\n(mclmatrix\nbegin\n";
+  for ( size_t node {}; node < rows.size(); ++node ) {
+    auto& row = rows[node];
+    if ( row.empty() ) continue;
+    std::sort( row.begin(), row.end() );
+    tout << id[node] << ' ' << graph.name( node ) << '\n';
+    mout << id[node];
+    for ( const auto& e : row ) mout << ' ' << id[e.first] << ':' << QString::number( e.second );
+    mout << " $\n";
+  }
+  mout << ")\n";
+  mout.flush();
+  tout.flush();
+  return mci.commit() && tab.commit();
 }
 
 
-void internal_merge( std::vector<Atom>& atoms, unsigned long cmin, unsigned long cminchr,
-                     double nibthreshold, double cutoff,
-                     bool similar, double chargediff, QMap<QString, QVariant> cutmap )
-{
-  double best = 99999999.0;
-  while ( 1 < atoms.size() ) {
-    std::vector<double> distmat( atoms.size() * atoms.size(), 99999999.0 );
-    for ( size_t row {}; row + 1 < atoms.size(); ++row ) {
-      for ( size_t col {row + 1}; col < atoms.size(); ++col ) {
-        if ( sametype( atoms[row], atoms[col], similar, chargediff ) ) {
-          distmat[ row * atoms.size() + col ] = distance( atoms[row], atoms[col] );
+//!
+//! Molecules of the model in order. Molecules are either loaded already
+//! or parsed when asked for; earlier molecules are released.
+//!
+class MoleculeStream {
+public:
+  explicit MoleculeStream( std::vector<Molecule>&& mols )
+  {
+    for ( auto& mol : mols ) window.push_back( std::move( mol ) );
+  }
+
+  explicit MoleculeStream( std::unique_ptr<Mol2Reader> reader ) : reader{std::move( reader )} {}
+
+  //! Molecules of several files, in order. Files are read ahead by 'files'.
+  MoleculeStream( std::unique_ptr<Prefetch> files, const ParseOptions& options )
+    : files{std::move( files )}, options{options}
+  {}
+
+  //! Molecule 'i', or nullptr when there are no more. Indices must not decrease.
+  const Molecule* get( size_t i )
+  {
+    while ( first + window.size() <= i ) {
+      if ( ! readone() ) return nullptr;
+    }
+    while ( first < i ) {
+      window.pop_front();
+      ++first;
+    }
+    return &window.front();
+  }
+
+  //! True, if the model has more than one molecule. May read ahead.
+  bool multiple()
+  {
+    while ( first + window.size() < 2 && readone() ) {}
+    return 1 < first + window.size();
+  }
+
+  //! Atoms of the next molecule, moved out of the stream.
+  //! Returns false, when there are no more molecules.
+  bool take( std::vector<Mol2Atom>& atoms )
+  {
+    if ( window.empty() && ! readone() ) return false;
+    atoms = std::move( window.front().atoms );
+    window.pop_front();
+    ++first;
+    return true;
+  }
+
+  //! True, if a file could not be read. The reason has been reported.
+  bool failed() const { return failure; }
+
+  //! All remaining molecules
+  std::vector<Molecule> all()
+  {
+    while ( readone() ) {}
+    std::vector<Molecule> mols;
+    mols.reserve( window.size() );
+    for ( auto& mol : window ) mols.push_back( std::move( mol ) );
+    window.clear();
+    return mols;
+  }
+
+private:
+  bool readone()
+  {
+    for ( ;; ) {
+      if ( reader ) {
+        PhaseTimer timer( "parse" );
+        std::vector<Molecule> mol;
+        if ( reader->next( mol ) ) {
+          window.push_back( std::move( mol.front() ) );
+          return true;
         }
       }
+      if ( ! files || ! openfile() ) return false;
+    }
+  }
+
+  //! Parse the next file of 'files'. Returns false, when there are no more.
+  bool openfile()
+  {
+    if ( inflated && ! inflated->error().isEmpty() ) {
+      std::cerr << "Can't read " << qPrintable(current) << ": " << qPrintable(inflated->error()) << "\n";
+      failure = true;
     }
-    auto nearest = std::min_element( begin(distmat), end(distmat) );
-    best = *nearest;
-    auto pos = std::distance( begin(distmat), nearest );
-    double limit = cutoff;
-    auto it = cutmap.find( atoms[ pos / atoms.size() ].type );
-    if ( it != cutmap.end() ) {
-      const double limit2 = it.value().toDouble();
-      if ( limit2 < limit ) {
-        limit = limit2;
+    reader.reset();
+    inflated.reset();
+    buffer.reset();
+
+    Prefetch::File file;
+    while ( files->next( file ) ) {
+      current = file.name;
+      if ( ! file.error.isEmpty() ) {
+        std::cerr << "Can't read " << qPrintable(file.name) << ": " << qPrintable(file.error) << "\n";
+        failure = true;
+        continue;
       }
-      limit = it.value().toDouble();
+      QIODevice* input {};
+      if ( Compression::None == file.format ) {
+        buffer.reset( new QBuffer );
+        buffer->setData( file.content );
+        buffer->open( QIODevice::ReadOnly );
+        input = buffer.get();
       }
-    // use the smaller cutoff when atomtypes can differ
-    it = cutmap.find( atoms[ pos % atoms.size() ].type );
-    if ( it != cutmap.end() ) {
-      const double limit2 = it.value().toDouble();
-      if ( limit2 < limit ) {
-        limit = limit2;
+      else {
+        inflated.reset( new InflateDevice( file.name, file.format ) );
+        if ( ! inflated->open() ) {
+          std::cerr << "File " << qPrintable(file.name) << " is " << compressionname( file.format )
+                    << " compressed, which this build does not support.\n";
+          failure = true;
+          inflated.reset();
+          continue;
+        }
+        input = inflated.get();
       }
+      reader.reset( new Mol2Reader( *input, options ) );
+      return true;
     }
-    // only atoms within cutoff limit can be merged
-    if ( limit < best ) break;
-
-    auto& to = atoms[ pos / atoms.size() ].posit;
-    const auto& from = atoms[ pos % atoms.size() ].posit;
-    to.insert( to.end(), from.begin(), from.end() );
+    return false;
+  }
 
-    // keep the most extreme charge in the cluster
-    double& toc = atoms[ pos / atoms.size() ].charge;
-    const double frc = atoms[ pos % atoms.size() ].charge;
-    if ( std::abs(toc) < std::abs(frc) ) toc = frc;
+  // the current file of 'files' is read from 'buffer' or 'inflated'
+  std::unique_ptr<Prefetch> files;
+  ParseOptions options;
+  QString current;
+  std::unique_ptr<QBuffer> buffer;
+  std::unique_ptr<InflateDevice> inflated;
+  bool failure {false};
+
+  std::unique_ptr<Mol2Reader> reader;
+  std::deque<Molecule> window;
+  size_t first {};
+};
 
-    atoms.erase( begin(atoms) + (pos % atoms.size()) );
-  }
 
-  atoms.erase( std::remove_if( atoms.begin(), atoms.end(),
-                               [cmin,nibthreshold](const Atom& x)
-                               { return x.posit.size() < cmin &&
-                                   std::abs(x.charge) <= nibthreshold;
-                               }
-                 ),
-               atoms.end());
-  atoms.erase( std::remove_if( atoms.begin(), atoms.end(),
-                               [cminchr,nibthreshold](const Atom& x)
-                               { return x.posit.size() < cminchr &&
-                                   nibthreshold < std::abs(x.charge);
-                               }
-                 ),
-               atoms.end());
+//!
+//! Process molecules in stages that run in own threads:
+//! reader -> binner -> clusterer -> writer (the calling thread).
+//! Stages are connected by queues of 'depth' molecules, so that parsing
+//! and writing overlap with clustering and a slow stage holds back the
+//! stages before it. Each stage handles the molecules in order, hence the
+//! output is the same as in a sequential loop.
+//! 'bin' maps atoms to bins, 'cluster' maps molecule index and bins to
+//! text, and 'write' outputs the text.
+//!
+template<class Bin, class Cluster, class Write>
+void pipeline( MoleculeStream& molecules, size_t depth, Bin bin, Cluster cluster, Write write )
+{
+  using Bins = std::map<int,std::vector<Atom>>;
+  BoundedQueue<std::vector<Mol2Atom>> parsed( depth );
+  BoundedQueue<Bins> binned( depth );
+  BoundedQueue<std::string> clustered( depth );
+
+  std::thread reader( [&]() {
+    std::vector<Mol2Atom> atoms;
+    while ( molecules.take( atoms ) && parsed.push( std::move( atoms ) ) ) {}
+    parsed.close();
+  } );
+  std::thread binner( [&]() {
+    std::vector<Mol2Atom> atoms;
+    while ( parsed.pop( atoms ) && binned.push( bin( atoms ) ) ) {}
+    binned.close();
+  } );
+  std::thread clusterer( [&]() {
+    Bins bins;
+    for ( size_t i {}; binned.pop( bins ); ++i ) {
+      if ( ! clustered.push( cluster( i, bins ) ) ) break;
+    }
+    clustered.close();
+  } );
+
+  std::string text;
+  while ( clustered.pop( text ) ) write( text );
+  reader.join();
+  binner.join();
+  clusterer.join();
 }
 
 
-void internal_method( std::map<int,std::vector<Atom>>& atomcats, size_t molecule,
-                      double cutoff, const QCommandLineParser& parser, bool similar,
-                      double chargediff, int argc, char *argv[],
-                      unsigned long cmin, unsigned long cminchr, double nibthreshold,
-                      QMap<QString, QVariant> cutmap )
-{
-  std::vector<Atom> atoms;
-  size_t original_count {};
-  for ( auto& cat : atomcats ) {
-    auto& acat = cat.second;
-    original_count += acat.size();
-    internal_merge( acat, cmin, cminchr, nibthreshold, cutoff, similar, chargediff, cutmap );
-    atoms.insert( atoms.end(), begin(acat), end(acat) );
-  }
+// requests from signal handlers during online_method
+volatile std::sig_atomic_t snapshotrequest {0};
+volatile std::sig_atomic_t stoprequest {0};
 
-  QString prefix = parser.value( "prefix" );
-  std::cout << "# Output from overlap " << qPrintable( QCoreApplication::applicationVersion() ) << '\n';
-  std::cout << "# Created: " << qPrintable(QDateTime::currentDateTime().toString()) << '\n';
-  std::cout << "# Command:";
-  for (int a{}; a < argc; ++a ) std::cout << ' ' << argv[a];
-  std::cout << '\n';
-  if ( atoms.size() == original_count ) {
-    std::cerr << "# Note: No atoms were merged due to overlap\n";
-    std::cout << "#\n# Note: No atoms were merged due to overlap\n";
-  }
-  std::cout << '\n';
-  header( std::cout, QString("%1%2").arg(prefix).arg(molecule), atoms.size() );
-  unsigned long num {0};
-  for ( auto atom : atoms ) {
-    ++num;
-    print( std::cout, atom, num );
-    std::cout << '\n';
-  }
-  std::cout << '\n';
-}
+extern "C" void requestsnapshot( int ) { snapshotrequest = 1; }
+extern "C" void requeststop( int ) { stoprequest = 1; }
 
 
 //!
-//! Bin atoms according to type
+//! Cluster molecules as they arrive from 'input'. A reader thread parses
+//! and bins the molecules, and ingest threads merge each atom into the
+//! nearest compatible cluster within cutoff, or make it a new cluster,
+//! as append_method does. Clusters are written as a model on SIGUSR1 and
+//! at the end of input. A 'follow'ed file ends on SIGINT or SIGTERM.
+//! Memory grows with the number of clusters, not with the atoms.
 //!
-std::map<int,std::vector<Atom>> atoms2bins( const std::vector<QStringList>& atoms,
-                                            bool usenib, bool nibneutral, double nibthreshold,
-                                            const QStringList& deletelist )
+int online_method( QIODevice& input, FollowDevice* follow, int threads, size_t depth,
+                   bool usenib, bool nibneutral, const QStringList& deletelist,
+                   double cutoff, const QString& prefix, bool similar,
+                   double chargediff, int argc, char *argv[],
+                   unsigned long cmin, unsigned long cminchr, double nibthreshold,
+                   const QMap<QString, QVariant>& cutmap )
 {
-  std::map<int,std::vector<Atom>> atomcats;
-  for ( size_t e = 0; e < atoms.size(); ++e ) {
-    const auto& atom = atoms[e];
-    if ( atom.size() == 9 ) {
-      QString type = atom[5];
-      double charge = atom[8].toDouble();
-      if ( usenib ) {
-        if ( charge < -nibthreshold ) {
-          type = "O.3";
-        }
-        else if  ( charge > nibthreshold ) {
-          type = "N.3";
-        }
-        else {
-          if ( nibneutral ) charge = 0.0;
-          if ( type != "C.ar" ){
-            type = "C.3";
+  // Grid cell covers the cutoffs of real types. The placeholders "_none"
+  // of cutoffs.json are far longer; their atoms search more cells instead.
+  double cell = cutoff;
+  for ( auto it = cutmap.begin(); it != cutmap.end(); ++it ) {
+    bool ok {false};
+    const double limit = it.value().toDouble( &ok );
+    if ( ok && 0 < limit && ! it.key().endsWith( "_none" ) ) cell = std::max( cell, limit );
+  }
+  ConcurrentClusters clusters( cell, [&]( const Cluster& c, const Cluster& atom ) {
+    if ( ! sametype( c.type, c.charge, atom.type, atom.charge, similar, chargediff ) ) return -1.0;
+    return pairlimit( c.type, atom.type, cutoff, cutmap );
+  } );
+
+  ParseOptions options;
+  options.bonds = false;
+  options.substructures = false;
+  if ( ! usenib ) options.deletetypes = deletelist;
+  Mol2Reader reader( input, options );
+
+  using Bins = std::map<int,std::vector<Atom>>;
+  BoundedQueue<Bins> parsed( std::max( size_t(1), depth ) * threads );
+  std::atomic<unsigned long> molecules {0};
+  std::atomic<unsigned long long> atoms {0};
+  std::atomic<int> running {threads + 1};
+
+  std::vector<std::thread> workers;
+  workers.emplace_back( [&]() {
+    for ( ;; ) {
+      std::vector<Molecule> mol;
+      {
+        PhaseTimer timer( "parse" );
+        if ( ! reader.next( mol ) ) break;
+      }
+      if ( ! parsed.push( atoms2bins( mol.front().atoms, usenib, nibneutral, nibthreshold, deletelist ) ) ) break;
+    }
+    parsed.close();
+    --running;
+  } );
+  for ( int t {}; t < threads; ++t ) {
+    workers.emplace_back( [&]() {
+      Bins bins;
+      while ( parsed.pop( bins ) ) {
+        PhaseTimer timer( "ingest" );
+        for ( const auto& cat : bins ) {
+          for ( const auto& atom : cat.second ) {
+            Cluster c;
+            c.type = atom.type;
+            c.sum = atom.sum;
+            c.count = atom.count;
+            c.charge = atom.charge;
+            // a merge limit is at most the limit of the type of the atom
+            clusters.add( cat.first, c, typelimit( c.type, cutoff, cutmap ) );
           }
+          atoms += cat.second.size();
         }
+        ++molecules;
       }
+      --running;
+    } );
+  }
 
-      if ( ! deletelist.contains( type ) ) {
-        int tcat = atomtype(type);
-        auto acount = atomcats[tcat].size();
-        atomcats[tcat].emplace_back( atom[0],
-                                     QString( "%1_%2_%3" ).arg(tcat).arg(acount).arg(atom[1]),
-                                     Point{atom[2].toDouble(), atom[3].toDouble(), atom[4].toDouble()},
-                                     type, charge );
-      }
+  unsigned long snapshots {};
+  auto write = [&]() {
+    PhaseTimer timer( "output" );
+    auto all = clusters.snapshot();
+    std::sort( all.begin(), all.end(), []( const Cluster& l, const Cluster& r ) {
+      const auto lp = l.pos();
+      const auto rp = r.pos();
+      return std::tie( l.type, lp.x, lp.y, lp.z ) < std::tie( r.type, rp.x, rp.y, rp.z );
+    } );
+    std::ostringstream ostr;
+    unsigned long num {0};
+    for ( const auto& c : all ) {
+      const bool charged = nibthreshold < std::abs(c.charge);
+      if ( c.count < (charged ? cminchr : cmin) ) continue;
+      ++num;
+      print( ostr, Atom( num, QString(), c.pos(), c.type, c.charge ), num );
+      ostr << '\n';
+    }
+
+    banner( std::cout, argc, argv );
+    std::cout << qPrintable( QString( "#\n# Online: %1 atoms of %2 molecules in %3 clusters\n" )
+                             .arg( atoms ).arg( molecules ).arg( all.size() ) );
+    std::cout << '\n';
+    header( std::cout, QString("%1%2").arg(prefix).arg(snapshots++), num );
+    std::cout << ostr.str() << '\n' << std::flush;
+  };
+
+#ifdef SIGUSR1
+  std::signal( SIGUSR1, requestsnapshot );
+#endif
+  if ( follow ) {
+    std::signal( SIGINT, requeststop );
+    std::signal( SIGTERM, requeststop );
+  }
+  while ( 0 < running ) {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+    if ( stoprequest && follow ) follow->finish();
+    if ( snapshotrequest ) {
+      snapshotrequest = 0;
+      write();
     }
   }
-  return atomcats;
+  for ( auto& worker : workers ) worker.join();
+  write();
+  return 0;
 }
 
 
 //!
-//! Output pairs of atoms with similarity (computed from distance with cutoffs)
+//! Answer queries of 'queryfile' ('-' for standard input) from the index
+//! in 'indexfile'. A query is a line:
+//!   radius <type> <x> <y> <z> <r>
+//!   nearest <type> <x> <y> <z> [<k> [<maxdist>]]
+//! Type '*' matches all clusters. Other types match exactly, or with
+//! 'similar' by category. Queries are answered in parallel and their
+//! hits written in order, one line per hit.
 //!
-void bins2abc( std::ostream& ostr, const std::map<int,std::vector<Atom>>& atomcats,
-               double cutoff, bool similar,
-               double chargediff, QMap<QString, QVariant> cutmap )
+int query_method( const QString& indexfile, const QString& queryfile, bool similar, int threads )
 {
-  for ( const auto& cat : atomcats ) {
-    const auto& acat = cat.second;
-    for ( size_t row {}; row + 1 < acat.size(); ++row ) {
-      double maxdist = cutoff * cutoff;
-      auto it = cutmap.find(acat[row].type);
-      if ( it != cutmap.end() ) {
-        maxdist = it.value().toDouble();
-        maxdist *= maxdist;
-      }
-      for ( size_t col {row + 1}; col < acat.size(); ++col ) {
-        if ( sametype( acat[row], acat[col], similar, chargediff ) ) {
-          auto d = maxdist - sdist( acat[row], acat[col] );
-          if ( 0 < d ) {
-            ostr << qPrintable( QString( "%1 %2 %3\n" )
-                                .arg(acat[row].name )
-                                .arg(acat[col].name )
-                                .arg( d ) );
-          }
-        }
+  HotspotIndex index;
+  {
+    PhaseTimer timer( "load" );
+    if ( ! index.load( indexfile.toStdString() ) ) {
+      std::cerr << "Can't read index " << qPrintable(indexfile) << "\n";
+      return 5;
+    }
+  }
+
+  struct Query {
+    bool nearest;
+    HotspotIndex::Filter filter;
+    Point pos;
+    double radius;
+    size_t k;
+  };
+  std::vector<Query> queries;
+  {
+    PhaseTimer timer( "parse" );
+    std::ifstream file;
+    if ( queryfile != "-" ) {
+      file.open( queryfile.toStdString() );
+      if ( ! file ) {
+        std::cerr << "Can't open file " << qPrintable(queryfile) << "\n";
+        return 5;
+      }
+    }
+    std::istream& input = queryfile == "-" ? std::cin : file;
+    std::string line;
+    for ( size_t number = 1; std::getline( input, line ); ++number ) {
+      std::istringstream words( line );
+      std::string kind;
+      std::string type;
+      if ( !( words >> kind ) || '#' == kind.front() ) continue;
+      Query query {};
+      query.nearest = kind == "nearest";
+      query.radius = std::numeric_limits<double>::infinity();
+      query.k = 1;
+      bool valid = ( query.nearest || kind == "radius" )
+        && ( words >> type >> query.pos.x >> query.pos.y >> query.pos.z );
+      if ( valid && ! query.nearest ) valid = bool( words >> query.radius );
+      size_t k {};
+      double maxdist {};
+      if ( valid && query.nearest && ( words >> k ) ) {
+        query.k = k;
+        if ( words >> maxdist ) query.radius = maxdist;
+      }
+      if ( ! valid ) {
+        std::cerr << "Invalid query on line " << number << ": " << line << "\n";
+        return 2;
       }
+      if ( type != "*" ) {
+        if ( similar ) query.filter.cat = atomtype( QString::fromStdString( type ) );
+        else query.filter.type = type;
+      }
+      queries.push_back( query );
     }
   }
+
+  PhaseTimer timer( "query" );
+  std::vector<std::string> answers( queries.size() );
+  parallel_for( queries.size(), threads, [&]( size_t q ) {
+    const auto& query = queries[q];
+    std::vector<HotspotIndex::Hit> hits;
+    if ( query.nearest ) index.nearest( query.pos, query.k, query.filter, hits, query.radius );
+    else index.radius( query.pos, query.radius, query.filter, hits );
+    std::ostringstream out;
+    out << std::fixed;
+    for ( const auto& hit : hits ) {
+      const auto& spot = index.spots()[hit.spot];
+      out << std::setprecision( 4 ) << q + 1 << ' ' << spot.molecule << ' ' << spot.serial << ' '
+          << hit.dist << ' ' << spot.pos << ' ' << index.types()[spot.type] << ' '
+          << std::setprecision( 3 ) << spot.charge << ' ' << spot.count << '\n';
+    }
+    answers[q] = out.str();
+  } );
+
+  std::cout << "# query molecule atom distance x y z type charge count\n";
+  for ( const auto& answer : answers ) std::cout << answer;
+  return 0;
 }
 
 
 int main( int argc, char *argv[] )
 {
-  QCoreApplication app(argc, argv);
+  // time to first input, shown with option --stats
+  std::unique_ptr<PhaseTimer> startup( new PhaseTimer( "startup" ) );
+
+  // QCoreApplication is created only when needed, by help and mcl
+  std::unique_ptr<QCoreApplication> app;
   QCoreApplication::setOrganizationName("SBL");
   QCoreApplication::setApplicationName("o-lap");
   QCoreApplication::setApplicationVersion("2023-08-10");
@@ -453,10 +2163,10 @@ int main( int argc, char *argv[] )
     "Output is either a mol2 model, input for MCL, or atom types in MCL clusters.");
   const auto helpOption = parser.addHelpOption();
   parser.addVersionOption();
-  parser.addOption( {"cutoffs", "JSON formatted cutoffs for atom types. Defaults are are from file 'cutoffs.json'.", "file/json" } );
+  parser.addOption( {"cutoffs", "JSON formatted cutoffs for atom types. Added to the built-in defaults, see '--showcutoffs'.", "file/json" } );
   parser.addOption( {{"c", "cutoff"}, "Cutoff distance. Effective only when shorter than default atomtype specific values (default: 1.1)", "num", "1.1"} );
   parser.addOption( {"showcutoffs", "Show JSON formatted cutoffs for atom types and exit." } );
-  parser.addOption( {"similarjson", "JSON formatted atom types.", "file" } );
+  parser.addOption( {"similarjson", "JSON formatted atom types. Replaces the built-in defaults.", "file" } );
   parser.addOption( {"showsimilar", "Show similar atom types and exit." } );
   parser.addOption( {{"s", "similar"}, "Cluster similar atom types. Types are similar, if in same category. See '--showsimilar'"} );
   parser.addOption( {"chargediff", "Charges must be within <num> to cluster (default: 0.2).", "num", "0.2"} );
@@ -467,15 +2177,58 @@ int main( int argc, char *argv[] )
   parser.addOption( {"clustermin", "Minimum size of cluster to include (default: 1).", "int", "1"} );
   parser.addOption( {"clusterminchr", "Minimum size of cluster for charged atoms. Atom is charged, if abs(charge) exceeds nibthreshold. (default: clustermin)", "int"} );
   parser.addOption( {"abcout", "Create ABC-format input for MCL and exit."} );
+  parser.addOption( {"gzip", "Compress output of --abcout with gzip."} );
+  parser.addOption( {"mcxout", "Create MCL native matrix <base>.mci and label file <base>.tab of all molecules and exit.", "base"} );
   parser.addOption( {"mcl", "Create ABC-format input for MCL and run MCL."} );
-  parser.addOption( {"mclI", "MCL main inflation value.", "num"} );
+  parser.addOption( {"mclI", "MCL main inflation value. Comma-separated list of values creates a model for each value.", "num"} );
   parser.addOption( {"mclte", "MCL expansion thread number.", "int"} );
   parser.addOption( {"mapmcl", "Map mcl clusters to atoms. The <file> must be output from MCL that corresponds to the model.", "file"} );
   parser.addOption( {"mcltype", "Show types of clustered atoms.  Requires mapmcl."} );
+  parser.addOption( {"threads", "Number of threads (default: all cores).", "int"} );
   parser.addOption( {"prefix", "Prefix of the output molecule's name (default: model).", "str", "model"} );
-  parser.addPositionalArgument("model", QCoreApplication::translate("main", "Mol2-file"));
+  parser.addOption( {"state", "Append model to clusters in state <file>. State is created, if it does not exist, and updated.", "file"} );
+  parser.addOption( {"showstate", "Write all clusters of the state of --state as model and exit."} );
+  parser.addOption( {"partial", "Write weighted clusters (member count, sum of coordinates, extreme charge) of the model into <file> for --reduce, instead of a model.", "file"} );
+  parser.addOption( {"reduce", "Merge partial results, given as arguments instead of a model, and write a model, or with --partial, a partial result."} );
+  parser.addOption( {"stats", "Show counters of work done on stderr."} );
+  parser.addOption( {"perf", "With --stats, count cycles, instructions, cache misses, branch misses and page faults of each phase (Linux)."} );
+  parser.addOption( {"cache", "Binary cache of the parsed model. Used when up to date with the model, otherwise (re)created.", "file"} );
+  parser.addOption( {"engine", "Clustering engine: auto, dense, sparse, or mcl (same as --mcl). Auto chooses dense or sparse for each bin (default: auto).", "str", "auto"} );
+  parser.addOption( {"max-memory", "Memory limit in MB for the auto engine (default: 0, no limit).", "num", "0"} );
+  parser.addOption( {"time-budget", "Seconds for the run. Bins that would exceed it use the sparse engine or stop with partial clusters (default: 0, no limit).", "num", "0"} );
+  parser.addOption( {"memory-budget", "Memory in MB for merging a bin. Bins that would exceed it use the sparse engine or stop with partial clusters (default: 0, no limit).", "num", "0"} );
+  parser.addOption( {"queue-depth", "Molecules queued between the read, bin, cluster and write stages of the default method. 0 runs the stages in sequence (default: 4).", "int", "4"} );
+  parser.addOption( {"spatialsort", "Order atoms of each bin along a space-filling curve before clustering and graph construction. Results do not change."} );
+  parser.addOption( {"online", "Cluster the model as it streams in: threads merge each atom into the nearest compatible cluster. A model file is followed as it grows until SIGINT or SIGTERM. SIGUSR1 writes the clusters so far."} );
+  parser.addOption( {"selfcheck", "Cluster the model <int> more times with shuffled atoms and varying threads, compare with a sequential run, and exit.", "int"} );
+  parser.addOption( {"index", "Write a spatial index of the clusters of the output models into <file>. With --query, the index to read.", "file"} );
+  parser.addOption( {"query", "Answer radius and nearest cluster queries in <file> ('-' for standard input) from the index of --index, and exit.", "file"} );
+  parser.addOption( {"prefetch", "Files read at once, when several models are given (default: 8).", "int", "8"} );
+  parser.addPositionalArgument("model", QCoreApplication::translate("main", "Mol2-files, or '-' for standard input. Molecules of several files are numbered in sequence. Partial results with --reduce."));
+
+  QStringList arguments;
+  for ( int a {}; a < argc; ++a ) arguments << QString::fromLocal8Bit( argv[a] );
+  if ( !parser.parse( arguments ) ) {
+    std::cerr << qPrintable( parser.errorText() ) << '\n';
+    return 1;
+  }
+  if ( parser.isSet( "version" ) ) parser.showVersion();
+  if ( parser.isSet( helpOption ) || arguments.contains( "--help-all" ) ) {
+    // process() shows the help, with the options of Qt for --help-all
+    app.reset( new QCoreApplication( argc, argv ) );
+    parser.process( *app );
+  }
 
-  parser.process( app );
+  // report counters on any return from here on
+  struct Reporter {
+    bool show;
+    std::unique_ptr<PhaseTimer> startup;
+    ~Reporter() {
+      startup.reset();
+      if ( show ) report( std::cerr );
+    }
+  } reporter { parser.isSet( "stats" ), std::move( startup ) };
+  if ( reporter.show && parser.isSet( "perf" ) ) enablecounters();
   double cutoff = parser.value( "cutoff" ).toDouble();
   double chargediff = parser.value( "chargediff" ).toDouble();
   double nibthreshold = parser.value( "nibthreshold" ).toDouble();
@@ -492,6 +2245,31 @@ int main( int argc, char *argv[] )
 
   QString prefix = parser.value( "prefix" );
 
+  int threads = QThread::idealThreadCount();
+  if ( parser.isSet( "threads" ) ){
+    threads = std::max( 1, parser.value( "threads" ).toInt() );
+  }
+
+  Engine engine = Engine::Auto;
+  const QString enginename = parser.value( "engine" );
+  if ( enginename == "dense" ) engine = Engine::Dense;
+  else if ( enginename == "sparse" ) engine = Engine::Sparse;
+  else if ( enginename != "auto" && enginename != "mcl" ) {
+    std::cerr << "Unknown engine " << qPrintable(enginename) << ".\n";
+    return 2;
+  }
+  const bool usemcl = parser.isSet( "mcl" ) || enginename == "mcl";
+  if ( usemcl ) app.reset( new QCoreApplication( argc, argv ) );
+  const double maxmemory = std::max( 0.0, parser.value( "max-memory" ).toDouble() ) * 1048576;
+  const double timebudget = parser.value( "time-budget" ).toDouble();
+  if ( 0 < timebudget ) {
+    budget.deadline = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( timebudget ) );
+  }
+  budget.memory = std::max( 0.0, parser.value( "memory-budget" ).toDouble() ) * 1048576;
+  const bool spatial = parser.isSet( "spatialsort" );
+  const size_t queuedepth = std::max( 0, parser.value( "queue-depth" ).toInt() );
+
   bool usenib = false;
   if ( parser.isSet( "nib" ) ){
     usenib = true;
@@ -502,7 +2280,11 @@ int main( int argc, char *argv[] )
   }
 
 
-  QMap<QString, QVariant> cutmap = readjson( "cutoffs.json", parser.value( "cutoffs" ) );
+  // a cutoffs.json of the user replaces the compiled-in defaults
+  const QString installedcutoffs = locatejson( "cutoffs.json" );
+  QMap<QString, QVariant> cutmap = readjson( installedcutoffs.isEmpty() ? defaultcutoffs()
+                                             : readjson( {}, installedcutoffs ),
+                                             parser.value( "cutoffs" ) );
   auto it = cutmap.find("*");
   if ( it != cutmap.end() ) cutoff = it.value().toDouble();
 
@@ -521,24 +2303,15 @@ int main( int argc, char *argv[] )
   }
 
 
+  // an atomtypes.json of the user replaces the compiled-in defaults
   QString similarjson = parser.value( "similarjson" );
-  if ( similarjson.isEmpty() )
-  {
-    similarjson = QStandardPaths::locate( QStandardPaths::AppDataLocation, "atomtypes.json" );
-    if ( similarjson.isEmpty() ) {
-      QDir myloc( QCoreApplication::applicationDirPath() );
-      myloc.cdUp();
-      myloc.cd( "share" );
-      myloc.cd( QCoreApplication::organizationName() );
-      myloc.cd( QCoreApplication::applicationName() );
-      if ( myloc.exists() ) {
-        similarjson = myloc.path() + "/atomtypes.json";
-      }
-    }
+  if ( similarjson.isEmpty() ) similarjson = locatejson( "atomtypes.json" );
+  if ( similarjson.isEmpty() ) {
+    atomtypes = defaultatomtypes();
   }
-
-  if ( ! similarjson.isEmpty() )
+  else
   {
+    defaulttypes = false;
     QByteArray ba;
     QFileInfo fi(similarjson);
     if ( fi.isFile() ) {
@@ -555,6 +2328,8 @@ int main( int argc, char *argv[] )
       for ( auto o = std::begin(smap); o != std::end(smap); ++o ) {
         atomtypes[ qPrintable(o.key()) ] = o.value().toInt();
       }
+      // the fast lookup of defaults applies, if the table equals them
+      defaulttypes = atomtypes == defaultatomtypes();
     }
     else{
       std::cout << "JSON state:" << qPrintable( err.errorString() ) << '\n';
@@ -583,88 +2358,390 @@ int main( int argc, char *argv[] )
     return 2;
   }
 
+  const QString partialfile = parser.value( "partial" );
+  if ( ! partialfile.isEmpty() && ( usemcl || parser.isSet( "state" ) ) ) {
+    std::cerr << "Option --partial can't be combined with --mcl or --state.\n";
+    return 2;
+  }
+
+  const bool online = parser.isSet( "online" );
+  if ( online && ( usemcl || parser.isSet( "state" ) || ! partialfile.isEmpty() || parser.isSet( "reduce" )
+                   || parser.isSet( "abcout" ) || parser.isSet( "mcxout" ) || parser.isSet( "mapmcl" )
+                   || parser.isSet( "selfcheck" ) || parser.isSet( "cache" ) ) ) {
+    std::cerr << "Option --online can't be combined with --mcl, --state, --partial, --reduce,"
+              << " --abcout, --mcxout, --mapmcl, --selfcheck or --cache.\n";
+    return 2;
+  }
+
+  const QString indexfile = parser.value( "index" );
+  if ( parser.isSet( "query" ) ) {
+    if ( indexfile.isEmpty() ) {
+      std::cerr << "Option --query requires --index.\n";
+      return 2;
+    }
+    reporter.startup.reset();
+    return query_method( indexfile, parser.value( "query" ), similar, threads );
+  }
+  if ( ! indexfile.isEmpty() && ( usemcl || parser.isSet( "state" ) || ! partialfile.isEmpty()
+                                  || parser.isSet( "reduce" ) || parser.isSet( "abcout" )
+                                  || parser.isSet( "mcxout" ) || parser.isSet( "mapmcl" )
+                                  || parser.isSet( "selfcheck" ) || online ) ) {
+    std::cerr << "Option --index applies only to the model of the default method.\n";
+    return 2;
+  }
+
+  if ( parser.isSet( "showstate" ) ) {
+    const QString statefile = parser.value( "state" );
+    if ( statefile.isEmpty() ) {
+      std::cerr << "Option --showstate requires --state.\n";
+      return 2;
+    }
+    StateFile state;
+    if ( ! QFile::exists( statefile ) || ! openstate( state, statefile, cutoff ) ) {
+      std::cerr << "Can't read state " << qPrintable(statefile) << "\n";
+      return 5;
+    }
+    reporter.startup.reset();
+    showstate_method( state, prefix, argc, argv, cmin, cminchr, nibthreshold );
+    return 0;
+  }
+
   const auto positionalArguments = parser.positionalArguments();
-  if ( positionalArguments.size() != 1 ) {
+  if ( parser.isSet( "reduce" ) ) {
+    reporter.startup.reset();
+    return reduce_method( positionalArguments, partialfile, prefix, cutoff, similar, chargediff,
+                          argc, argv, cmin, cminchr, nibthreshold, cutmap, engine, maxmemory,
+                          threads );
+  }
+  else if ( positionalArguments.isEmpty() ) {
+    app.reset( new QCoreApplication( argc, argv ) );
     parser.showHelp( 1 );
   }
   else {
-    QFile file( positionalArguments.at(0) );
-    if ( !file.exists() ) {
-      std::cerr << "File " << qPrintable(file.fileName()) << " does not exist.\n";
-      return 4;
+    reporter.startup.reset();
+    // "-" is standard input; input from it or a pipe is processed while it is read
+    const QString model = positionalArguments.at(0);
+    const bool many = 1 < positionalArguments.size();
+    QFile file;
+    if ( many ) {
+      // the files are opened as they are read ahead
+      if ( positionalArguments.contains( "-" ) ) {
+        std::cerr << "Standard input can't be combined with other models.\n";
+        return 2;
+      }
+      if ( online ) {
+        std::cerr << "Option --online takes one model.\n";
+        return 2;
+      }
+      for ( const auto& name : positionalArguments ) {
+        if ( !QFile::exists( name ) ) {
+          std::cerr << "File " << qPrintable(name) << " does not exist.\n";
+          return 4;
+        }
+      }
     }
-    if ( !file.open(QIODevice::ReadOnly | QIODevice::Text) ) {
-      std::cerr << "Can't open file " << qPrintable(file.fileName()) << "\n";
-      return 5;
+    else if ( model == "-" ) {
+      if ( !file.open( stdin, QIODevice::ReadOnly | QIODevice::Text ) ) {
+        std::cerr << "Can't read standard input\n";
+        return 5;
+      }
+    }
+    else {
+      file.setFileName( model );
+      if ( !file.exists() ) {
+        std::cerr << "File " << qPrintable(file.fileName()) << " does not exist.\n";
+        return 4;
+      }
+      if ( !file.open(QIODevice::ReadOnly | QIODevice::Text) ) {
+        std::cerr << "Can't open file " << qPrintable(file.fileName()) << "\n";
+        return 5;
+      }
+    }
+    const bool regular = ! many && model != "-" && QFileInfo( model ).isFile();
+
+    if ( online ) {
+      // a regular file is followed as it grows
+      std::unique_ptr<FollowDevice> follow;
+      QIODevice* input = &file;
+      if ( regular ) {
+        if ( Compression::None != compression( model ) ) {
+          std::cerr << "Option --online can't follow a compressed model.\n";
+          return 2;
+        }
+        file.close();
+        follow.reset( new FollowDevice( model ) );
+        if ( !follow->open() ) {
+          std::cerr << "Can't open file " << qPrintable(model) << "\n";
+          return 5;
+        }
+        input = follow.get();
+      }
+      return online_method( *input, follow.get(), threads, queuedepth, usenib, nibneutral,
+                            deletelist, cutoff, prefix, similar, chargediff, argc, argv,
+                            cmin, cminchr, nibthreshold, cutmap );
     }
 
-    QTextStream in( &file );
-    auto mols = parse( in );
+    QString cachefile = parser.value( "cache" );
+    if ( ! cachefile.isEmpty() && ! regular ) {
+      std::cerr << "# Note: --cache requires a regular file as model\n";
+      cachefile.clear();
+    }
 
-    for ( size_t i=0; i < mols.size(); ++i )
-    {
-      auto bins = atoms2bins( mols[i].atoms, usenib, nibneutral,
-                              nibthreshold, deletelist );
+    std::unique_ptr<InflateDevice> inflated;
+    std::unique_ptr<MoleculeStream> molecules;
+    auto inputfailed = [&]() {
+      if ( molecules && molecules->failed() ) return true;
+      if ( ! inflated || inflated->error().isEmpty() ) return false;
+      std::cerr << "Can't read " << qPrintable(model) << ": " << qPrintable(inflated->error()) << "\n";
+      return true;
+    };
+
+    std::vector<Molecule> mols;
+    if ( ! cachefile.isEmpty() && loadcache( cachefile, model, mols ) ) {
+      molecules.reset( new MoleculeStream( std::move( mols ) ) );
+    }
+    else {
+      // only atoms are clustered; atom types are final here unless nib retypes them.
+      // The cache must keep all atoms, for it is used with any options.
+      ParseOptions options;
+      options.bonds = false;
+      options.substructures = false;
+      if ( ! usenib && cachefile.isEmpty() ) options.deletetypes = deletelist;
+
+      if ( many ) {
+        // files are read ahead by a pool of threads while earlier ones are parsed
+        const size_t prefetch = std::max( 1, parser.value( "prefetch" ).toInt() );
+        std::unique_ptr<Prefetch> files( new Prefetch( positionalArguments, prefetch, 2 * prefetch ) );
+        molecules.reset( new MoleculeStream( std::move( files ), options ) );
+      }
+      else {
+        QIODevice* input = &file;
+        const auto format = regular ? compression( model ) : Compression::None;
+        if ( Compression::None != format ) {
+          // decompressed on a background thread while parsing
+          inflated.reset( new InflateDevice( model, format ) );
+          if ( !inflated->open() ) {
+            std::cerr << "File " << qPrintable(model) << " is " << compressionname( format )
+                      << " compressed, which this build does not support.\n";
+            return 5;
+          }
+          input = inflated.get();
+        }
 
-      QString mcldata = parser.value( "mapmcl" );
-      if ( ! mcldata.isEmpty() )
-      {
-        QFile data( mcldata );
-        if ( data.open(QFile::ReadOnly) ) {
-          QTextStream input( &data );
-          if ( parser.isSet( "mcltype" ) ) {
-            QString str;
-            QTextStream output( &str );
-            mcl2types( input, bins, output );
-            std::cout << qPrintable( str );
+        std::unique_ptr<Mol2Reader> reader( new Mol2Reader( *input, options ) );
+        if ( cachefile.isEmpty() ) {
+          molecules.reset( new MoleculeStream( std::move( reader ) ) );
+        }
+        else {
+          {
+            PhaseTimer timer( "parse" );
+            while ( reader->next( mols ) ) {}
           }
-          else {
-            mcl2atoms( input, bins, i, prefix, argc, argv, cmin, cminchr, nibthreshold );
+          if ( inputfailed() ) return 5;
+          if ( ! savecache( cachefile, model, mols ) ) {
+            std::cerr << "# Note: Could not write cache " << qPrintable(cachefile) << '\n';
           }
+          molecules.reset( new MoleculeStream( std::move( mols ) ) );
         }
       }
-      else if ( parser.isSet( "abcout" ) )
-      {
-        bins2abc( std::cout, bins, cutoff, similar, chargediff, cutmap );
+    }
+
+    if ( parser.isSet( "selfcheck" ) ) {
+      const auto mols = molecules->all();
+      if ( inputfailed() ) return 5;
+      const auto failed = selfcheck( mols, parser.value( "selfcheck" ).toULong(), threads,
+                                     engine, maxmemory, spatial, usenib, nibneutral, deletelist,
+                                     cmin, cminchr, nibthreshold, cutoff, similar,
+                                     chargediff, cutmap );
+      std::cout << "# Self-check: " << failed << " runs differ\n";
+      return failed ? 3 : 0;
+    }
+
+    const QString mcxbase = parser.value( "mcxout" );
+    if ( ! mcxbase.isEmpty() ) {
+      // one graph of all molecules, labels tagged as in --abcout
+      BinGraph graph( cutoff, similar, chargediff, cutmap );
+      for ( size_t i=0; const Molecule* mol = molecules->get( i ); ++i ) {
+        const auto bins = atoms2bins( mol->atoms, usenib, nibneutral,
+                                      nibthreshold, deletelist, spatial );
+        graph.add( bins, molecules->multiple() ? QString( "m%1_" ).arg( i ) : QString() );
       }
-      else if ( parser.isSet( "mcl" ) )
-      {
-        std::ostringstream ostr;
-        bins2abc( ostr, bins, cutoff, similar, chargediff, cutmap );
-
-        if ( ostr.str().empty() ) {
-          std::cerr << "# Note: No atoms were merged due to overlap\n";
-        } else {
-          // Use 'mcl' for clustering and map result back to atoms
-          QProcess mcl;
-          QStringList mclopt {"-", "--abc", "-V", "all" };
-          if ( parser.isSet( "mclI" ) ) {
-            mclopt << "-I" << parser.value( "mclI" );
-          }
-          if ( parser.isSet( "mclte" ) ) {
-            mclopt << "--te" << parser.value( "mclte" );
-          }
-          mclopt << "-o" << "-";
+      if ( inputfailed() ) return 5;
+      if ( ! graph2mcx( graph, mcxbase, threads ) ) {
+        std::cerr << "Can't write " << qPrintable(mcxbase) << ".mci\n";
+        return 5;
+      }
+      return 0;
+    }
+
+    QString mcldata = parser.value( "mapmcl" );
+    if ( ! mcldata.isEmpty() )
+    {
+      QFile data( mcldata );
+      if ( !data.open(QFile::ReadOnly) ) {
+        std::cerr << "Can't open file " << qPrintable(data.fileName()) << "\n";
+        return 5;
+      }
+      const auto blocks = readmcl( data );
+
+      if ( parser.isSet( "mcltype" ) ) {
+        for ( size_t i=0; const Molecule* mol = molecules->get( i ); ++i ) {
+          auto bins = atoms2bins( mol->atoms, usenib, nibneutral,
+                                  nibthreshold, deletelist );
+          QString str;
+          QTextStream output( &str );
+          mcl2types( mcllines( blocks, i ), bins, output );
+          output.flush();
+          std::cout << qPrintable( str );
+        }
+      }
+      else {
+        // map molecules in parallel, write in order
+        const auto mols = molecules->all();
+        const bool weighted = ! partialfile.isEmpty();
+        std::vector<std::vector<Atom>> fused( mols.size() );
+        parallel_for( mols.size(), threads, [&]( size_t i ) {
+          // without MCL lines every atom is a cluster of its own
+          const auto lines = mcllines( blocks, i );
+          auto bins = atoms2bins( mols[i].atoms, usenib, nibneutral,
+                                  nibthreshold, deletelist );
+          fused[i] = weighted ? mcl2atoms( lines, bins, 1, 1, nibthreshold )
+                              : mcl2atoms( lines, bins, cmin, cminchr, nibthreshold );
+        } );
+        ClusterState partial;
+        for ( size_t i=0; i < mols.size(); ++i ) {
+          if ( weighted ) partial.clusters( i ) = atoms2clusters( fused[i] );
+          else mclmodel( std::cout, fused[i], i, prefix, argc, argv );
+        }
+        if ( weighted && ! partial.write( partialfile ) ) {
+          std::cerr << "Can't write partial result " << qPrintable(partialfile) << "\n";
+          return 5;
+        }
+      }
+      return inputfailed() ? 5 : 0;
+    }
+
+    const QString statefile = parser.value( "state" );
+    StateFile state;
+    if ( ! statefile.isEmpty() && ! openstate( state, statefile, cutoff ) ) {
+      std::cerr << "Can't read state " << qPrintable(statefile) << "\n";
+      return 5;
+    }
+
+    std::ostream* abcstream = &std::cout;
+    std::unique_ptr<std::streambuf> gzbuf;
+    std::unique_ptr<std::ostream> gzout;
+    if ( parser.isSet( "abcout" ) && parser.isSet( "gzip" ) ) {
+      gzbuf = gzipbuf( std::cout );
+      if ( ! gzbuf ) {
+        std::cerr << "Option --gzip requires a build with zlib.\n";
+        return 2;
+      }
+      gzout.reset( new std::ostream( gzbuf.get() ) );
+      abcstream = gzout.get();
+    }
 
-          mcl.start("mcl", mclopt );
-          if ( !mcl.waitForStarted() ) {
-            std::cerr << "Failed to start mcl\n";
-            return 1;
+    ClusterState partial;
+    IndexSpots spots;
+    IndexSpots* index = indexfile.isEmpty() ? nullptr : &spots;
+
+    if ( 0 < queuedepth && ! parser.isSet( "abcout" ) && ! usemcl && statefile.isEmpty() ) {
+      // default method and --partial as a pipeline
+      pipeline( *molecules, queuedepth,
+                [&]( const std::vector<Mol2Atom>& atoms ) {
+                  return atoms2bins( atoms, usenib, nibneutral, nibthreshold, deletelist, spatial );
+                },
+                [&]( size_t i, std::map<int,std::vector<Atom>>& bins ) {
+                  std::ostringstream ostr;
+                  if ( ! partialfile.isEmpty() ) {
+                    // clustermin applies only to the model of --reduce
+                    partial.clusters( i ) =
+                      atoms2clusters( internal_clusters( bins, threads, engine, maxmemory, 1, 1,
+                                                         nibthreshold, cutoff, similar, chargediff,
+                                                         cutmap, ostr ) );
+                    return std::string();
+                  }
+                  internal_method( ostr, bins, i, cutoff, parser, similar, chargediff,
+                                   argc, argv, cmin, cminchr, nibthreshold, cutmap, engine,
+                                   maxmemory, threads, index );
+                  return ostr.str();
+                },
+                []( const std::string& text ) {
+                  // a downstream stage may be waiting for the molecule
+                  std::cout << text << std::flush;
+                } );
+    }
+    else {
+      for ( size_t i=0; const Molecule* mol = molecules->get( i ); ++i )
+      {
+        // mclsweep maps the clusters of mcl with the model order of bins
+        auto bins = atoms2bins( mol->atoms, usenib, nibneutral,
+                                nibthreshold, deletelist, spatial && ! usemcl );
+
+        if ( parser.isSet( "abcout" ) )
+        {
+          // tag labels by molecule, when there is more than one
+          const QString tag = molecules->multiple() ? QString( "m%1_" ).arg( i ) : QString();
+          bins2abc( *abcstream, bins, cutoff, similar, chargediff, cutmap, tag, threads );
+        }
+        else if ( usemcl )
+        {
+          std::ostringstream ostr;
+          bins2abc( ostr, bins, cutoff, similar, chargediff, cutmap, QString(), threads );
+
+          if ( ostr.str().empty() ) {
+            std::cerr << "# Note: No atoms were merged due to overlap\n";
+          } else {
+            // Use 'mcl' for clustering and map result back to atoms
+#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
+            auto inflations = parser.value( "mclI" ).split( ',', QString::SkipEmptyParts );
+#else
+            auto inflations = parser.value( "mclI" ).split( ',', Qt::SkipEmptyParts );
+#endif
+            const int status = mclsweep( ostr.str(), inflations, parser.value( "mclte" ),
+                                         bins, i, prefix, argc, argv, cmin, cminchr, nibthreshold );
+            if ( 0 != status ) return status;
           }
-          mcl.write( ostr.str().c_str() );
-          mcl.closeWriteChannel();
-          if ( !mcl.waitForFinished( -1 ) ) {
-            return 2;
+        }
+        else if ( ! partialfile.isEmpty() )
+        {
+          // clustermin applies only to the model of --reduce
+          std::ostringstream plans;
+          partial.clusters( i ) =
+            atoms2clusters( internal_clusters( bins, threads, engine, maxmemory, 1, 1, nibthreshold,
+                                               cutoff, similar, chargediff, cutmap, plans ) );
+        }
+        else if ( ! statefile.isEmpty() )
+        {
+          if ( ! append_method( state, bins, i, cutoff, prefix, similar, chargediff,
+                                argc, argv, cmin, cminchr, nibthreshold, cutmap, engine, maxmemory ) ) {
+            std::cerr << "Can't write state " << qPrintable(statefile) << "\n";
+            return 5;
           }
-          QTextStream input( mcl.readAllStandardOutput() );
-          mcl2atoms( input, bins, i, prefix, argc, argv, cmin, cminchr, nibthreshold );
         }
+        else
+        {
+          // Use iterative "combine nearest" to merge atoms that are within cutoff
+          internal_method( std::cout, bins, i, cutoff, parser, similar, chargediff,
+                           argc, argv, cmin, cminchr, nibthreshold, cutmap, engine, maxmemory,
+                           threads, index );
+        }
+        // a downstream stage may be waiting for the molecule
+        abcstream->flush();
       }
-      else
-      {
-        // Use iterative "combine nearest" to merge atoms that are within cutoff
-        internal_method( bins, i, cutoff, parser, similar, chargediff,
-                         argc, argv, cmin, cminchr, nibthreshold, cutmap );
+    }
+    if ( inputfailed() ) return 5;
+
+    if ( ! partialfile.isEmpty() && ! parser.isSet( "abcout" ) && ! partial.write( partialfile ) ) {
+      std::cerr << "Can't write partial result " << qPrintable(partialfile) << "\n";
+      return 5;
+    }
+    if ( index ) {
+      PhaseTimer timer( "index" );
+      const HotspotIndex built( std::move( spots.spots ), std::move( spots.types ), std::move( spots.cats ) );
+      if ( ! built.save( indexfile.toStdString() ) ) {
+        std::cerr << "Can't write index " << qPrintable(indexfile) << "\n";
+        return 5;
       }
     }
   }